@@ -0,0 +1,391 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <getopt.h>
+#include <ftw.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+/*
+Benchmark every copyit_extracredit method and thread count over a set of
+synthetic trees.  The trees come from a seeded generator, so the same seed
+and scale always produce byte-identical inputs and comparable numbers.
+*/
+
+#define MAX_LIST 16
+#define MB (1024 * 1024)
+
+// One generated input tree.
+typedef struct {
+    const char *name;
+    void (*generate)(const char *dir);
+} profile_t;
+
+// One measured copy.
+typedef struct {
+    double seconds;
+    long long files;
+    long long bytes;
+    long long syscalls;
+    long peak_rss_kb;
+    int status;
+} result_t;
+
+unsigned long long rng_state;
+int scale = 1;
+const char *copyit_path = "./copyit_extracredit";
+int drop_caches_ok = -1;
+
+// xorshift64*: small, fast and identical on every platform.
+unsigned long long rng_next() {
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+void fail(const char *what, const char *path) {
+    fprintf(stderr, "copybench: %s %s: %s\n", what, path, strerror(errno));
+    exit(1);
+}
+
+void make_dir(const char *path) {
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+        fail("couldn't create directory", path);
+    }
+}
+
+// Write size pseudo-random bytes at offset, keeping whatever else the file holds.
+void write_random(int fd, off_t offset, off_t size, const char *path) {
+    static unsigned long long block[MB / sizeof(unsigned long long)];
+
+    while (size > 0) {
+        size_t n = size < MB ? size : MB;
+        for (size_t i = 0; i < (n + 7) / 8; i++) {
+            block[i] = rng_next();
+        }
+        if (pwrite(fd, block, n, offset) != (ssize_t)n) {
+            fail("couldn't write", path);
+        }
+        offset += n;
+        size -= n;
+    }
+}
+
+void make_file(const char *path, off_t size) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        fail("couldn't create", path);
+    }
+    write_random(fd, 0, size, path);
+    close(fd);
+}
+
+void gen_tiny(const char *dir) {
+    char path[PATH_MAX];
+    int ndirs = 20 * scale;
+
+    for (int d = 0; d < ndirs; d++) {
+        snprintf(path, sizeof(path), "%s/d%03d", dir, d);
+        make_dir(path);
+        for (int f = 0; f < 250; f++) {
+            snprintf(path, sizeof(path), "%s/d%03d/f%03d", dir, d, f);
+            make_file(path, rng_next() % 4096);
+        }
+    }
+}
+
+void gen_huge(const char *dir) {
+    char path[PATH_MAX];
+
+    for (int f = 0; f < 2; f++) {
+        snprintf(path, sizeof(path), "%s/huge%d", dir, f);
+        make_file(path, (off_t)64 * MB * scale + rng_next() % 4096);
+    }
+}
+
+// Mostly holes, with a few randomly placed data extents.
+void gen_sparse(const char *dir) {
+    char path[PATH_MAX];
+
+    for (int f = 0; f < 2; f++) {
+        off_t size = (off_t)256 * MB * scale;
+        snprintf(path, sizeof(path), "%s/disk%d", dir, f);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0 || ftruncate(fd, size) != 0) {
+            fail("couldn't create", path);
+        }
+        for (int e = 0; e < 8; e++) {
+            off_t offset = (rng_next() % (size / MB - 1)) * MB;
+            write_random(fd, offset, MB, path);
+        }
+        close(fd);
+    }
+}
+
+void gen_deep(const char *dir) {
+    char path[PATH_MAX];
+    size_t len = snprintf(path, sizeof(path), "%s", dir);
+
+    for (int level = 0; level < 40 * scale && len + 16 < sizeof(path); level++) {
+        len += snprintf(path + len, sizeof(path) - len, "/l%d", level);
+        make_dir(path);
+        for (int f = 0; f < 5; f++) {
+            char file[PATH_MAX + 8];
+            snprintf(file, sizeof(file), "%s/f%d", path, f);
+            make_file(file, rng_next() % 65536);
+        }
+    }
+}
+
+profile_t profiles[] = {
+    { "tiny", gen_tiny },
+    { "huge", gen_huge },
+    { "sparse", gen_sparse },
+    { "deep", gen_deep },
+};
+#define NUM_PROFILES (int)(sizeof(profiles) / sizeof(profiles[0]))
+
+int remove_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    return remove(path);
+}
+
+void remove_tree(const char *path) {
+    nftw(path, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+int evict_entry(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+    if (type == FTW_F && S_ISREG(st->st_mode)) {
+        int fd = open(path, O_RDONLY);
+        if (fd >= 0) {
+            fdatasync(fd);
+            posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+            close(fd);
+        }
+    }
+    return 0;
+}
+
+/*
+Start each run with a cold cache: drop the whole page cache when we are
+allowed to, otherwise at least evict the source tree's own pages.
+*/
+void cold_cache(const char *src) {
+    if (drop_caches_ok != 0) {
+        sync();
+        int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+        drop_caches_ok = fd >= 0 && write(fd, "3", 1) == 1;
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    if (!drop_caches_ok) {
+        nftw(src, evict_entry, 64, FTW_PHYS);
+    }
+}
+
+// Sum the numbers in the "syscalls" object of copyit's --stats-json output.
+long long parse_stats(const char *path, long long *files, long long *bytes) {
+    char text[8192];
+    long long total = 0;
+    FILE *f = fopen(path, "r");
+
+    if (!f) {
+        return -1;
+    }
+    size_t n = fread(text, 1, sizeof(text) - 1, f);
+    fclose(f);
+    text[n] = 0;
+
+    char *p = strstr(text, "\"files\":");
+    *files = p ? atoll(p + 8) : 0;
+    p = strstr(text, "\"bytes\":");
+    *bytes = p ? atoll(p + 8) : 0;
+
+    p = strstr(text, "\"syscalls\":");
+    char *end = p ? strchr(p, '}') : NULL;
+    while (p && (p = strchr(p, ':')) && p < end) {
+        p++;
+        total += atoll(p);
+    }
+    return total;
+}
+
+result_t run_copy(const char *src, const char *dest, const char *method, int threads, const char *stats) {
+    char jobs[16];
+    struct timespec start, end;
+    struct rusage ru;
+    result_t r = { 0 };
+    int status;
+
+    snprintf(jobs, sizeof(jobs), "%d", threads);
+    // Don't let a run that writes no stats pick up the previous run's.
+    unlink(stats);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDOUT_FILENO);
+        execl(copyit_path, copyit_path, "-e", method, "-j", jobs, "--stats-json", stats, src, dest, (char *)NULL);
+        perror("copybench: couldn't run copyit_extracredit");
+        exit(127);
+    } else if (pid < 0) {
+        perror("copybench: fork");
+        exit(1);
+    }
+
+    wait4(pid, &status, 0, &ru);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    r.seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    r.peak_rss_kb = ru.ru_maxrss;
+    r.status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    r.syscalls = parse_stats(stats, &r.files, &r.bytes);
+    if (r.syscalls < 0 && r.status == 0) {
+        // It claimed success but left no stats behind, so its numbers can't be trusted.
+        r.status = -1;
+    }
+    return r;
+}
+
+// Split a comma-separated list in place.
+int split_list(char *list, char **items) {
+    int n = 0;
+    for (char *tok = strtok(list, ","); tok && n < MAX_LIST; tok = strtok(NULL, ",")) {
+        items[n++] = tok;
+    }
+    return n;
+}
+
+void show_help() {
+    printf("Use: copybench [options]\n");
+    printf("Where options are:\n");
+    printf("-s <seed>     Seed for the generated trees. (default=1)\n");
+    printf("-z <scale>    Multiply the size of every tree. (default=1)\n");
+    printf("-e <methods>  Comma-separated copy methods. (default=range,sendfile,splice,uring,mmap,buffered)\n");
+    printf("-j <threads>  Comma-separated thread counts. (default=1,4)\n");
+    printf("-p <profiles> Comma-separated trees: tiny,huge,sparse,deep. (default=all)\n");
+    printf("-d <dir>      Directory for the trees. (default=$TMPDIR or /tmp)\n");
+    printf("-o <file>     CSV output file. (default=copybench.csv)\n");
+    printf("-c <path>     copyit_extracredit binary. (default=./copyit_extracredit)\n");
+    printf("-h            Show this help text.\n");
+}
+
+int main(int argc, char *argv[]) {
+    char default_methods[] = "range,sendfile,splice,uring,mmap,buffered";
+    char default_threads[] = "1,4";
+    char default_profiles[] = "tiny,huge,sparse,deep";
+    char *method_list = default_methods, *thread_list = default_threads, *profile_list = default_profiles;
+    const char *csv_path = "copybench.csv";
+    const char *base = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    unsigned long long seed = 1;
+    int c;
+
+    while ((c = getopt(argc, argv, "s:z:e:j:p:d:o:c:h")) != -1) {
+        switch (c) {
+            case 's':
+                seed = strtoull(optarg, NULL, 0);
+                break;
+            case 'z':
+                scale = atoi(optarg) > 0 ? atoi(optarg) : 1;
+                break;
+            case 'e':
+                method_list = optarg;
+                break;
+            case 'j':
+                thread_list = optarg;
+                break;
+            case 'p':
+                profile_list = optarg;
+                break;
+            case 'd':
+                base = optarg;
+                break;
+            case 'o':
+                csv_path = optarg;
+                break;
+            case 'c':
+                copyit_path = optarg;
+                break;
+            default:
+                show_help();
+                exit(1);
+        }
+    }
+
+    char *methods[MAX_LIST], *threads[MAX_LIST], *wanted[MAX_LIST];
+    int nmethods = split_list(method_list, methods);
+    int nthreads = split_list(thread_list, threads);
+    int nwanted = split_list(profile_list, wanted);
+
+    char workdir[PATH_MAX];
+    snprintf(workdir, sizeof(workdir), "%s/copybench.XXXXXX", base);
+    if (!mkdtemp(workdir)) {
+        fail("couldn't create work directory in", base);
+    }
+
+    FILE *csv = fopen(csv_path, "w");
+    if (!csv) {
+        fail("couldn't create", csv_path);
+    }
+    fprintf(csv, "profile,method,threads,seconds,files,bytes,mb_per_s,files_per_s,syscalls,peak_rss_kb,status\n");
+
+    printf("copybench: seed=%llu scale=%d work=%s\n", seed, scale, workdir);
+    printf("%-8s %-9s %4s %9s %10s %11s %10s %10s %6s\n",
+           "profile", "method", "-j", "seconds", "MB/s", "files/s", "syscalls", "rss KiB", "status");
+
+    for (int p = 0; p < NUM_PROFILES; p++) {
+        int selected = 0;
+        for (int w = 0; w < nwanted; w++) {
+            selected |= strcmp(wanted[w], profiles[p].name) == 0;
+        }
+        if (!selected) {
+            continue;
+        }
+
+        char src[PATH_MAX + 32], dest[PATH_MAX + 32], stats[PATH_MAX + 32];
+        snprintf(src, sizeof(src), "%s/%s", workdir, profiles[p].name);
+        snprintf(dest, sizeof(dest), "%s/%s.copy", workdir, profiles[p].name);
+        snprintf(stats, sizeof(stats), "%s/stats.json", workdir);
+
+        // Every profile restarts the generator, so each tree depends only on the seed.
+        rng_state = seed * 0x9E3779B97F4A7C15ULL + p + 1;
+        make_dir(src);
+        profiles[p].generate(src);
+
+        for (int m = 0; m < nmethods; m++) {
+            for (int t = 0; t < nthreads; t++) {
+                remove_tree(dest);
+                cold_cache(src);
+
+                result_t r = run_copy(src, dest, methods[m], atoi(threads[t]), stats);
+                double mbps = r.seconds > 0 ? r.bytes / r.seconds / 1e6 : 0;
+                double fps = r.seconds > 0 ? r.files / r.seconds : 0;
+
+                printf("%-8s %-9s %4s %9.3f %10.1f %11.0f %10lld %10ld %6d\n",
+                       profiles[p].name, methods[m], threads[t], r.seconds, mbps, fps, r.syscalls, r.peak_rss_kb, r.status);
+                fprintf(csv, "%s,%s,%s,%.6f,%lld,%lld,%.3f,%.1f,%lld,%ld,%d\n",
+                        profiles[p].name, methods[m], threads[t], r.seconds, r.files, r.bytes, mbps, fps, r.syscalls, r.peak_rss_kb, r.status);
+                fflush(stdout);
+            }
+        }
+
+        remove_tree(dest);
+        remove_tree(src);
+    }
+
+    fclose(csv);
+    remove_tree(workdir);
+    printf("copybench: cache control: %s; results written to %s\n",
+           drop_caches_ok > 0 ? "dropped page cache" : "evicted source files", csv_path);
+    return 0;
+}
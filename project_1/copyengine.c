@@ -0,0 +1,1149 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <linux/io_uring.h>
+
+#include "copyengine.h"
+#include "copystats.h"
+
+// Largest amount handed to the kernel in one call, so a huge file does not
+// sit in a single uninterruptible syscall.
+#define COPY_CHUNK (64 * 1024 * 1024)
+
+// The read/write buffer starts at BUFFER_MIN and doubles while that keeps
+// raising throughput, up to BUFFER_MAX.  Each size is measured over
+// BUFFER_WINDOW reads before deciding.
+#define BUFFER_MIN (64 * 1024)
+#define BUFFER_MAX (8 * 1024 * 1024)
+#define BUFFER_WINDOW 8
+
+// Alignment of buffers, offsets and lengths for O_DIRECT.
+#define DIRECT_ALIGN 4096
+
+// Amount copied between page cache hints (drop-behind) in buffered mode.
+#define DROP_WINDOW (8 * 1024 * 1024)
+
+// Largest piece of the source mapped at once by the mmap method.
+#define MMAP_WINDOW (64 * 1024 * 1024)
+
+// Unit compared and rewritten by copy_delta().
+#define DELTA_BLOCK (256 * 1024)
+
+// Pipe capacity requested for the splice path (the default is only 64 KiB).
+#define SPLICE_PIPE_SIZE (1024 * 1024)
+
+static const char *method_names[COPY_METHOD_COUNT] = {
+    "range", "sendfile", "splice", "uring", "mmap", "buffered"
+};
+
+const char *copy_method_name( int method )
+{
+    if (method == COPY_AUTO) {
+        return "auto";
+    }
+    if (method < 0 || method >= COPY_METHOD_COUNT) {
+        return "unknown";
+    }
+    return method_names[method];
+}
+
+int copy_method_parse( const char *name )
+{
+    if (strcmp(name, "auto") == 0) {
+        return COPY_AUTO;
+    }
+    for (int i = 0; i < COPY_METHOD_COUNT; i++) {
+        if (strcmp(name, method_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -2;
+}
+
+// Errors meaning "this method cannot be used for these two files" rather than
+// a real I/O failure, so the next method should be tried.
+static int method_unsupported( int err )
+{
+    return err == ENOSYS || err == EXDEV || err == EINVAL || err == EOPNOTSUPP || err == ENOTSUP;
+}
+
+// Write all of buf to fd, retrying short and interrupted writes.
+static int write_all( int fd, const char *buf, size_t count )
+{
+    while (count > 0) {
+        STATS_CALL(CALL_WRITE);
+        ssize_t n = write(fd, buf, count);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            if (n == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        buf += n;
+        count -= n;
+    }
+    return 0;
+}
+
+// Set with copy_set_direct(): read/write copies bypass the page cache.
+static int use_direct;
+
+// Each thread keeps its read/write buffer, and the size it grew to, between files.
+static __thread char *thread_buffer;
+static __thread size_t thread_buffer_capacity;
+static __thread size_t thread_buffer_size = BUFFER_MIN;
+
+void copy_set_direct( int on )
+{
+    use_direct = on;
+}
+
+// Return the calling thread's page-aligned buffer, grown to at least size bytes.
+static char *buffer_get( size_t size )
+{
+    if (thread_buffer_capacity < size) {
+        void *p;
+        if (posix_memalign(&p, DIRECT_ALIGN, size) != 0) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        free(thread_buffer);
+        thread_buffer = p;
+        thread_buffer_capacity = size;
+    }
+    return thread_buffer;
+}
+
+static double now_seconds( void )
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Progress of the read/write loop within one copy_data() call.
+struct buffered_state {
+    int ready;
+    int direct;                 // O_DIRECT currently set on both descriptors
+    int src_flags, dest_flags;  // original file status flags, restored at the end
+    off_t src_pos, dest_pos;    // file offsets, or -1 if the files cannot seek
+    off_t dropped;              // bytes already dropped from the page cache
+    off_t flushing;             // start of the window whose writeback was started
+    double window_start;
+    int window_reads;
+    off_t window_bytes;
+    double last_rate;
+};
+
+static void buffered_begin( struct buffered_state *b, int src, int dest )
+{
+    struct stat st;
+
+    b->ready = 1;
+    b->src_pos = lseek(src, 0, SEEK_CUR);
+    b->dest_pos = lseek(dest, 0, SEEK_CUR);
+    b->dropped = 0;
+    b->flushing = -1;
+    b->window_start = now_seconds();
+    b->window_reads = 0;
+    b->window_bytes = 0;
+    b->last_rate = 0;
+
+    b->direct = 0;
+    b->src_flags = fcntl(src, F_GETFL);
+    b->dest_flags = fcntl(dest, F_GETFL);
+    if (use_direct && b->src_pos % DIRECT_ALIGN == 0 && b->dest_pos % DIRECT_ALIGN == 0) {
+        if (fcntl(src, F_SETFL, b->src_flags | O_DIRECT) == 0) {
+            if (fcntl(dest, F_SETFL, b->dest_flags | O_DIRECT) == 0) {
+                b->direct = 1;
+            } else {
+                fcntl(src, F_SETFL, b->src_flags);
+            }
+        }
+    }
+
+    if (!b->direct && fstat(src, &st) == 0 && S_ISREG(st.st_mode)) {
+        posix_fadvise(src, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+}
+
+static void buffered_direct_off( struct buffered_state *b, int src, int dest )
+{
+    if (b->direct) {
+        fcntl(src, F_SETFL, b->src_flags);
+        fcntl(dest, F_SETFL, b->dest_flags);
+        b->direct = 0;
+    }
+}
+
+/*
+Drop-behind: once a window of data has been copied, start its writeback, then
+wait for the previous window's writeback and drop both files' copies of it from
+the page cache, so a big copy does not evict everyone else's working set.
+*/
+static void buffered_drop_behind( struct buffered_state *b, int src, int dest, off_t total )
+{
+    if (b->direct || b->src_pos < 0 || b->dest_pos < 0 || total - b->dropped < DROP_WINDOW) {
+        return;
+    }
+
+    off_t len = total - b->dropped;
+    sync_file_range(dest, b->dest_pos + b->dropped, len, SYNC_FILE_RANGE_WRITE);
+    posix_fadvise(src, b->src_pos + b->dropped, len, POSIX_FADV_DONTNEED);
+    if (b->flushing >= 0) {
+        off_t prev = b->dropped - b->flushing;
+        sync_file_range(dest, b->dest_pos + b->flushing, prev,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(dest, b->dest_pos + b->flushing, prev, POSIX_FADV_DONTNEED);
+    }
+    b->flushing = b->dropped;
+    b->dropped = total;
+}
+
+// Double the buffer while the last window at the current size was clearly faster.
+static void buffered_adapt( struct buffered_state *b, size_t moved )
+{
+    b->window_bytes += moved;
+    if (++b->window_reads < BUFFER_WINDOW || thread_buffer_size >= BUFFER_MAX) {
+        return;
+    }
+
+    double now = now_seconds();
+    double rate = b->window_bytes / (now - b->window_start + 1e-9);
+    if (b->last_rate > 0 && rate > b->last_rate * 1.1) {
+        thread_buffer_size *= 2;
+    }
+    b->last_rate = rate;
+    b->window_start = now;
+    b->window_reads = 0;
+    b->window_bytes = 0;
+}
+
+static ssize_t move_buffered( struct buffered_state *b, int src, int dest, size_t count )
+{
+    char *buffer = buffer_get(thread_buffer_size);
+    ssize_t n;
+
+    if (!buffer) {
+        return -1;
+    }
+    if (count > thread_buffer_size) {
+        count = thread_buffer_size;
+    }
+    if (b->direct && count < DIRECT_ALIGN) {
+        // O_DIRECT needs whole blocks; a short final range goes through the cache.
+        buffered_direct_off(b, src, dest);
+    } else if (b->direct) {
+        count -= count % DIRECT_ALIGN;
+    }
+
+    do {
+        STATS_CALL(CALL_READ);
+        n = read(src, buffer, count);
+    } while (n < 0 && errno == EINTR);
+
+    if (n > 0 && b->direct && n % DIRECT_ALIGN != 0) {
+        // The unaligned tail at end of file: write it without O_DIRECT.
+        buffered_direct_off(b, src, dest);
+    }
+    if (n > 0 && write_all(dest, buffer, n) < 0) {
+        return -1;
+    }
+    if (n > 0) {
+        buffered_adapt(b, n);
+    }
+    return n;
+}
+
+/*
+Move up to count bytes from src through the pipe into dest.  Once bytes are in
+the pipe they have left src, so if dest refuses splice the pipe is drained with
+read()/write() instead of giving up.
+*/
+static ssize_t move_splice( int src, int dest, size_t count, int pipefd[2] )
+{
+    char *buffer = buffer_get(BUFFER_MIN);
+    size_t size = BUFFER_MIN;
+
+    if (!buffer) {
+        return -1;
+    }
+    if (pipefd[0] < 0) {
+        if (pipe2(pipefd, O_CLOEXEC) < 0) {
+            return -1;
+        }
+        fcntl(pipefd[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE);
+    }
+
+    STATS_CALL(CALL_SPLICE);
+    ssize_t in = splice(src, NULL, pipefd[1], NULL, count, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (in <= 0) {
+        return in;
+    }
+
+    ssize_t left = in;
+    while (left > 0) {
+        STATS_CALL(CALL_SPLICE);
+        ssize_t out = splice(pipefd[0], NULL, dest, NULL, left, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (out < 0 && errno == EINTR) {
+            continue;
+        }
+        if (out < 0 && method_unsupported(errno)) {
+            while (left > 0) {
+                STATS_CALL(CALL_READ);
+                ssize_t n = read(pipefd[0], buffer, (size_t)left < size ? (size_t)left : size);
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (n <= 0 || write_all(dest, buffer, n) < 0) {
+                    return -1;
+                }
+                left -= n;
+            }
+            break;
+        }
+        if (out <= 0) {
+            if (out == 0) {
+                errno = EIO;
+            }
+            return -1;
+        }
+        left -= out;
+    }
+    return in;
+}
+
+// Size of each registered io_uring buffer, and so of each read/write pair.
+#define URING_BLOCK (128 * 1024)
+
+// io_uring settings shared by every thread's ring (see copy_uring_configure).
+static int uring_depth = 16;
+static int uring_buffers = 32;
+
+// Totals over all rings, for the IOPS and bandwidth report.
+static atomic_llong uring_ios;
+static atomic_llong uring_bytes;
+
+/*
+A minimal io_uring instance driven through the raw system calls, with a set
+of registered buffers.  Each thread lazily creates its own.
+*/
+struct uring {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_size, cq_ring_size, sqes_size;
+    unsigned sq_pending;    // prepared but not yet handed to the kernel
+    char *buffers;
+    int nbufs;
+};
+
+static __thread struct uring *thread_ring;
+static __thread int thread_ring_failed;
+
+void copy_uring_configure( int depth, int buffers )
+{
+    if (depth > 0) {
+        uring_depth = depth;
+    }
+    if (buffers > 0) {
+        uring_buffers = buffers;
+    }
+}
+
+off_t copy_uring_block_size( void )
+{
+    return URING_BLOCK;
+}
+
+int copy_uring_batch_size( void )
+{
+    return uring_depth < uring_buffers ? uring_depth : uring_buffers;
+}
+
+void copy_uring_totals( long long *ios, long long *bytes )
+{
+    *ios = atomic_load(&uring_ios);
+    *bytes = atomic_load(&uring_bytes);
+}
+
+static void uring_destroy( struct uring *r )
+{
+    if (r->buffers) {
+        munmap(r->buffers, (size_t)r->nbufs * URING_BLOCK);
+    }
+    if (r->sqes) {
+        munmap(r->sqes, r->sqes_size);
+    }
+    if (r->cq_ring && r->cq_ring != r->sq_ring) {
+        munmap(r->cq_ring, r->cq_ring_size);
+    }
+    if (r->sq_ring) {
+        munmap(r->sq_ring, r->sq_ring_size);
+    }
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+    free(r);
+}
+
+void copy_uring_release( void )
+{
+    if (thread_ring) {
+        uring_destroy(thread_ring);
+        thread_ring = NULL;
+    }
+}
+
+/*
+Give up on this thread's ring after io_uring_enter() has failed.  Requests
+may still be in flight, reading into or writing from the registered buffers,
+so those stay mapped for good; closing the ring cancels the rest.  The thread
+copies without io_uring from then on.
+*/
+static void uring_abandon( void )
+{
+    thread_ring->buffers = NULL;
+    uring_destroy(thread_ring);
+    thread_ring = NULL;
+    thread_ring_failed = 1;
+}
+
+static struct uring *uring_create( unsigned entries, int nbufs )
+{
+    struct io_uring_params p;
+    struct uring *r = calloc(1, sizeof(*r));
+    if (!r) {
+        return NULL;
+    }
+
+    memset(&p, 0, sizeof(p));
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) {
+        free(r);
+        return NULL;
+    }
+
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_size > r->sq_ring_size) {
+            r->sq_ring_size = r->cq_ring_size;
+        }
+        r->cq_ring_size = r->sq_ring_size;
+    }
+
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) {
+        r->sq_ring = NULL;
+        goto fail;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+    } else {
+        r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) {
+            r->cq_ring = NULL;
+            goto fail;
+        }
+    }
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto fail;
+    }
+
+    r->sq_head = (unsigned *)((char *)r->sq_ring + p.sq_off.head);
+    r->sq_tail = (unsigned *)((char *)r->sq_ring + p.sq_off.tail);
+    r->sq_mask = (unsigned *)((char *)r->sq_ring + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)((char *)r->sq_ring + p.sq_off.array);
+    r->cq_head = (unsigned *)((char *)r->cq_ring + p.cq_off.head);
+    r->cq_tail = (unsigned *)((char *)r->cq_ring + p.cq_off.tail);
+    r->cq_mask = (unsigned *)((char *)r->cq_ring + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)((char *)r->cq_ring + p.cq_off.cqes);
+
+    // Register the data buffers once so reads and writes skip the per-I/O page pinning.
+    r->nbufs = nbufs;
+    r->buffers = mmap(NULL, (size_t)nbufs * URING_BLOCK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->buffers == MAP_FAILED) {
+        r->buffers = NULL;
+        goto fail;
+    }
+    struct iovec *iov = calloc(nbufs, sizeof(struct iovec));
+    if (!iov) {
+        goto fail;
+    }
+    for (int i = 0; i < nbufs; i++) {
+        iov[i].iov_base = r->buffers + (size_t)i * URING_BLOCK;
+        iov[i].iov_len = URING_BLOCK;
+    }
+    int registered = syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov, nbufs);
+    free(iov);
+    if (registered < 0) {
+        goto fail;
+    }
+    return r;
+
+fail:
+    uring_destroy(r);
+    return NULL;
+}
+
+// The calling thread's ring, or NULL with errno = ENOSYS if io_uring cannot be used here.
+static struct uring *uring_get( void )
+{
+    if (!thread_ring && !thread_ring_failed) {
+        thread_ring = uring_create(4 * uring_depth, copy_uring_batch_size());
+        thread_ring_failed = !thread_ring;
+    }
+    if (!thread_ring) {
+        errno = ENOSYS;
+    }
+    return thread_ring;
+}
+
+static struct io_uring_sqe *uring_sqe( struct uring *r, int op, int fd, unsigned long long user_data )
+{
+    unsigned tail = *r->sq_tail + r->sq_pending;
+    unsigned index = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->user_data = user_data;
+    r->sq_array[index] = index;
+    r->sq_pending++;
+    return sqe;
+}
+
+static void uring_prep_fixed( struct uring *r, int op, int fd, int buf, size_t skip, size_t len, off_t off, unsigned long long user_data, int link )
+{
+    struct io_uring_sqe *sqe = uring_sqe(r, op, fd, user_data);
+    sqe->addr = (unsigned long long)(r->buffers + (size_t)buf * URING_BLOCK + skip);
+    sqe->len = len;
+    sqe->off = off;
+    sqe->buf_index = buf;
+    if (link) {
+        sqe->flags |= IOSQE_IO_LINK;
+    }
+}
+
+// Hand every prepared entry to the kernel and wait for at least wait_nr completions.
+static int uring_submit( struct uring *r, unsigned wait_nr )
+{
+    unsigned submit = r->sq_pending;
+    __atomic_store_n(r->sq_tail, *r->sq_tail + submit, __ATOMIC_RELEASE);
+    r->sq_pending = 0;
+
+    while (submit > 0 || wait_nr > 0) {
+        STATS_CALL(CALL_IO_URING_ENTER);
+        int n = syscall(__NR_io_uring_enter, r->fd, submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        submit -= n;
+        wait_nr = 0;
+    }
+    return 0;
+}
+
+static int uring_peek( struct uring *r, struct io_uring_cqe *cqe )
+{
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+    *cqe = r->cqes[head & *r->cq_mask];
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+// One block of a file being copied through the ring, in the registered buffer of its slot.
+struct uring_block {
+    off_t off;          // offset from the start of this chunk
+    size_t len;
+    size_t done;        // bytes written so far
+    ssize_t avail;      // bytes read but not yet written, at buffer + done
+    int outstanding;    // operations still in the kernel
+};
+
+/*
+Queue the next step for a block: a read linked to a write of the same range,
+or a lone write if a short read or short write left data in the buffer.
+*/
+static void uring_block_step( struct uring *r, struct uring_block *b, int slot, int src, int dest, off_t in, off_t out )
+{
+    size_t left = b->len - b->done;
+
+    if (b->avail > 0) {
+        uring_prep_fixed(r, IORING_OP_WRITE_FIXED, dest, slot, b->done, b->avail, out + b->off + b->done, slot * 2 + 1, 0);
+        b->outstanding = 1;
+    } else {
+        uring_prep_fixed(r, IORING_OP_READ_FIXED, src, slot, b->done, left, in + b->off + b->done, slot * 2, 1);
+        uring_prep_fixed(r, IORING_OP_WRITE_FIXED, dest, slot, b->done, left, out + b->off + b->done, slot * 2 + 1, 0);
+        b->outstanding = 2;
+    }
+}
+
+/*
+Copy up to count bytes with a queue of in-flight read/write pairs,
+then move both file offsets past what was copied.
+*/
+static ssize_t move_uring( int src, int dest, size_t count )
+{
+    struct uring *r = uring_get();
+    if (!r) {
+        return -1;
+    }
+
+    off_t in = lseek(src, 0, SEEK_CUR);
+    off_t out = lseek(dest, 0, SEEK_CUR);
+    if (in < 0 || out < 0) {
+        errno = EINVAL;    // not seekable, so no offsets to give io_uring either
+        return -1;
+    }
+
+    // Only probe past the expected end of file one block at a time.
+    struct stat st;
+    if (fstat(src, &st) == 0 && S_ISREG(st.st_mode)) {
+        off_t left = st.st_size > in ? st.st_size - in : URING_BLOCK;
+        if ((off_t)count > left) {
+            count = left;
+        }
+    }
+
+    int nslots = copy_uring_batch_size();
+    struct uring_block blocks[nslots];
+    size_t next = 0, total = 0;
+    int active = 0, eof = 0, error = 0;
+
+    for (int i = 0; i < nslots && next < count; i++) {
+        blocks[i].off = next;
+        blocks[i].len = count - next < URING_BLOCK ? count - next : URING_BLOCK;
+        blocks[i].done = 0;
+        blocks[i].avail = 0;
+        next += blocks[i].len;
+        active++;
+        uring_block_step(r, &blocks[i], i, src, dest, in, out);
+    }
+
+    while (active > 0) {
+        struct io_uring_cqe cqe;
+
+        if (uring_submit(r, 1) < 0) {
+            // Nothing can be reaped any more.  The offsets have not moved, so copy_data()
+            // carries on from the same place with the next method.
+            uring_abandon();
+            errno = EINVAL;
+            return -1;
+        }
+
+        while (uring_peek(r, &cqe)) {
+            int slot = cqe.user_data / 2;
+            struct uring_block *b = &blocks[slot];
+            int res = cqe.res;
+
+            atomic_fetch_add(&uring_ios, 1);
+            if (cqe.user_data % 2 == 0) {
+                if (res < 0) {
+                    error = -res;
+                } else if (res == 0) {
+                    eof = 1;
+                    b->len = b->done;
+                } else {
+                    b->avail += res;
+                }
+            } else if (res > 0) {
+                b->avail -= res;
+                b->done += res;
+                atomic_fetch_add(&uring_bytes, res);
+            } else if (res < 0 && res != -ECANCELED) {
+                error = -res;
+            }
+
+            if (--b->outstanding > 0) {
+                continue;
+            }
+
+            if (!error && (b->avail > 0 || b->done < b->len)) {
+                uring_block_step(r, b, slot, src, dest, in, out);
+                continue;
+            }
+
+            // Block finished: reuse its slot for the next block, if any.
+            total += b->done;
+            if (!error && !eof && next < count) {
+                b->off = next;
+                b->len = count - next < URING_BLOCK ? count - next : URING_BLOCK;
+                b->done = 0;
+                b->avail = 0;
+                next += b->len;
+                uring_block_step(r, b, slot, src, dest, in, out);
+            } else {
+                active--;
+            }
+        }
+    }
+
+    if (error) {
+        errno = error;
+        return -1;
+    }
+    lseek(src, in + total, SEEK_SET);
+    lseek(dest, out + total, SEEK_SET);
+    return total;
+}
+
+int copy_uring_batch( struct copy_request *reqs, int n )
+{
+    struct uring *r = uring_get();
+    struct io_uring_cqe cqe;
+    int src_fd[n], dest_fd[n];
+
+    if (!r) {
+        return -1;
+    }
+
+    // First submission: open every source and target.
+    for (int i = 0; i < n; i++) {
+        struct io_uring_sqe *sqe = uring_sqe(r, IORING_OP_OPENAT, reqs[i].src_dir, i * 2);
+        sqe->addr = (unsigned long long)reqs[i].src_path;
+        sqe->open_flags = O_RDONLY | O_NOFOLLOW | O_CLOEXEC;
+
+        sqe = uring_sqe(r, IORING_OP_OPENAT, reqs[i].dest_dir, i * 2 + 1);
+        sqe->addr = (unsigned long long)reqs[i].dest_path;
+        sqe->open_flags = O_WRONLY | O_CREAT | (reqs[i].temporary ? O_EXCL : O_TRUNC) | O_NOFOLLOW | O_CLOEXEC;
+        sqe->len = 0644;
+    }
+    if (uring_submit(r, 2 * n) < 0) {
+        uring_abandon();
+        return -1;
+    }
+    for (int reaped = 0; reaped < 2 * n; ) {
+        if (!uring_peek(r, &cqe)) {
+            if (uring_submit(r, 1) < 0) {
+                uring_abandon();
+                return -1;
+            }
+            continue;
+        }
+        int i = cqe.user_data / 2;
+        if (cqe.user_data % 2 == 0) {
+            src_fd[i] = cqe.res;
+        } else {
+            dest_fd[i] = cqe.res;
+        }
+        atomic_fetch_add(&uring_ios, 1);
+        reaped++;
+    }
+
+    // Second submission: read -> write -> close chains into the registered buffers.
+    int expected = 0;
+    for (int i = 0; i < n; i++) {
+        reqs[i].result = src_fd[i] < 0 ? src_fd[i] : dest_fd[i] < 0 ? dest_fd[i] : 0;
+        if (src_fd[i] >= 0 && dest_fd[i] >= 0 && reqs[i].size > 0) {
+            uring_prep_fixed(r, IORING_OP_READ_FIXED, src_fd[i], i, 0, reqs[i].size, 0, i * 4, 1);
+            uring_prep_fixed(r, IORING_OP_WRITE_FIXED, dest_fd[i], i, 0, reqs[i].size, 0, i * 4 + 1, 1);
+            expected += 2;
+        }
+        if (dest_fd[i] >= 0) {
+            uring_sqe(r, IORING_OP_CLOSE, dest_fd[i], i * 4 + 2);
+            expected++;
+        }
+        if (src_fd[i] >= 0) {
+            uring_sqe(r, IORING_OP_CLOSE, src_fd[i], i * 4 + 3);
+            expected++;
+        }
+    }
+    // On failure the caller copies every file of the batch again, one at a time.
+    if (uring_submit(r, expected) < 0) {
+        uring_abandon();
+        return -1;
+    }
+    for (int reaped = 0; reaped < expected; ) {
+        if (!uring_peek(r, &cqe)) {
+            if (uring_submit(r, 1) < 0) {
+                uring_abandon();
+                return -1;
+            }
+            continue;
+        }
+        int i = cqe.user_data / 4;
+        int op = cqe.user_data % 4;
+        atomic_fetch_add(&uring_ios, 1);
+        reaped++;
+
+        if (op == 2 && cqe.res == -ECANCELED) {
+            // The chain broke before the close, so close the target ourselves.
+            close(dest_fd[i]);
+        } else if (op == 1 && cqe.res > 0) {
+            atomic_fetch_add(&uring_bytes, cqe.res);
+            STATS_BYTES(cqe.res);
+        }
+        if (reqs[i].result == 0 && ((op < 2 && cqe.res != reqs[i].size) || (op >= 2 && cqe.res < 0 && cqe.res != -ECANCELED))) {
+            reqs[i].result = cqe.res < 0 ? cqe.res : -EIO;
+        }
+    }
+    return 0;
+}
+
+static int mmap_flags;
+
+void copy_set_mmap_flags( int flags )
+{
+    mmap_flags = flags;
+}
+
+/*
+Copy up to count bytes by mapping a window of the source and writing it
+straight out of the mapping, without a user-space buffer.
+
+The mapping is only ever read by the kernel inside write(), so if the source
+is truncated while it is being copied the missing pages show up as EFAULT or a
+short write rather than SIGBUS.  Then the copy just stops at the new end of
+file, like read() would.
+*/
+static ssize_t move_mmap( int src, int dest, size_t count )
+{
+    static long page_size;
+    struct stat st;
+
+    if (!page_size) {
+        page_size = sysconf(_SC_PAGESIZE);
+    }
+
+    off_t pos = lseek(src, 0, SEEK_CUR);
+    if (pos < 0 || fstat(src, &st) != 0 || !S_ISREG(st.st_mode)) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (pos >= st.st_size) {
+        return 0;
+    }
+    if (count > MMAP_WINDOW) {
+        count = MMAP_WINDOW;
+    }
+    if ((off_t)count > st.st_size - pos) {
+        count = st.st_size - pos;
+    }
+
+    off_t map_off = pos - pos % page_size;
+    size_t map_len = pos - map_off + count;
+    int flags = MAP_SHARED | ((mmap_flags & COPY_MMAP_POPULATE) ? MAP_POPULATE : 0);
+    STATS_CALL(CALL_MMAP);
+    char *map = mmap(NULL, map_len, PROT_READ, flags, src, map_off);
+    if (map == MAP_FAILED) {
+        if (errno == ENODEV || errno == EACCES) {
+            errno = EINVAL;    // not mappable: let the next method try
+        }
+        return -1;
+    }
+    madvise(map, map_len, MADV_SEQUENTIAL);
+    if (mmap_flags & COPY_MMAP_HUGEPAGE) {
+        madvise(map, map_len, MADV_HUGEPAGE);
+    }
+
+    const char *data = map + (pos - map_off);
+    size_t done = 0;
+    while (done < count) {
+        STATS_CALL(CALL_WRITE);
+        ssize_t n = write(dest, data + done, count - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == EFAULT && fstat(src, &st) == 0 && st.st_size < pos + (off_t)count) {
+            break;    // the source shrank under us
+        }
+        if (n <= 0) {
+            if (n == 0) {
+                errno = EIO;
+            }
+            munmap(map, map_len);
+            return -1;
+        }
+        done += n;
+    }
+
+    munmap(map, map_len);
+    lseek(src, pos + done, SEEK_SET);
+    return done;
+}
+
+int copy_data( int src, int dest, off_t len, int method, off_t *copied )
+{
+    struct buffered_state buffered = { 0 };
+    int pipefd[2] = { -1, -1 };
+    off_t total = 0;
+    off_t moved = 0;    // bytes moved by the current method
+    struct stat st;
+    int result = -1;
+
+    if (use_direct) {
+        // Bypassing the page cache is only possible with our own buffers.
+        method = COPY_BUFFERED;
+    } else if (method == COPY_AUTO) {
+        // Pipes, devices and files that report a zero size (procfs, sysfs)
+        // are only reliably read with read().
+        if (fstat(src, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+            method = COPY_RANGE;
+        } else {
+            method = COPY_BUFFERED;
+        }
+    }
+
+    while (len < 0 || total < len) {
+        size_t want = COPY_CHUNK;
+        ssize_t n;
+
+        if (len >= 0 && len - total < (off_t)want) {
+            want = len - total;
+        }
+
+        switch (method) {
+            case COPY_RANGE:
+                STATS_CALL(CALL_COPY_FILE_RANGE);
+                n = copy_file_range(src, NULL, dest, NULL, want, 0);
+                break;
+            case COPY_SENDFILE:
+                STATS_CALL(CALL_SENDFILE);
+                n = sendfile(dest, src, NULL, want);
+                break;
+            case COPY_SPLICE:
+                n = move_splice(src, dest, want, pipefd);
+                break;
+            case COPY_URING:
+                n = move_uring(src, dest, want);
+                break;
+            case COPY_MMAP:
+                n = move_mmap(src, dest, want);
+                break;
+            default:
+                if (!buffered.ready) {
+                    buffered_begin(&buffered, src, dest);
+                }
+                n = move_buffered(&buffered, src, dest, want);
+                break;
+        }
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        // A method that fails, or claims end of file before moving anything,
+        // hands over to the next one at the current offsets.
+        if (method != COPY_BUFFERED && ((n < 0 && method_unsupported(errno)) || (n == 0 && moved == 0))) {
+            method++;
+            moved = 0;
+            continue;
+        }
+
+        if (n < 0) {
+            goto out;
+        }
+        if (n == 0) {
+            break;
+        }
+        total += n;
+        moved += n;
+        STATS_BYTES(n);
+        if (method == COPY_BUFFERED) {
+            buffered_drop_behind(&buffered, src, dest, total);
+        }
+    }
+    result = method;
+
+out:
+    if (buffered.ready) {
+        int saved = errno;
+        buffered_direct_off(&buffered, src, dest);
+        errno = saved;
+    }
+    if (pipefd[0] >= 0) {
+        int saved = errno;
+        close(pipefd[0]);
+        close(pipefd[1]);
+        errno = saved;
+    }
+    if (copied) {
+        *copied = total;
+    }
+    return result;
+}
+
+int copy_sparse( int src, int dest, int method, off_t *copied, off_t *logical )
+{
+    struct stat st, dest_st;
+    off_t pos = 0, total = 0;
+    int result = -1;
+
+    if (fstat(src, &st) != 0 || fstat(dest, &dest_st) != 0) {
+        return -1;
+    }
+    *logical = S_ISREG(st.st_mode) ? st.st_size : 0;
+
+    // Fully allocated files (and anything that is not a regular file) need no extent walk.
+    if (!S_ISREG(st.st_mode) || (off_t)st.st_blocks * 512 >= st.st_size) {
+        result = copy_data(src, dest, -1, method, copied);
+        if (result >= 0 && !S_ISREG(st.st_mode)) {
+            *logical = *copied;
+        }
+        return result;
+    }
+
+    while (pos < st.st_size) {
+        STATS_CALL(CALL_LSEEK);
+        off_t data = lseek(src, pos, SEEK_DATA);
+        if (data < 0 && errno == ENXIO) {
+            break;    // only a hole is left
+        }
+        if (data < 0) {
+            if (pos > 0) {
+                return -1;
+            }
+            // No SEEK_DATA on this filesystem: copy everything.
+            STATS_CALL(CALL_LSEEK);
+            lseek(src, 0, SEEK_SET);
+            return copy_data(src, dest, -1, method, copied);
+        }
+        STATS_CALL(CALL_LSEEK);
+        off_t hole = lseek(src, data, SEEK_HOLE);
+        if (hole < 0) {
+            return -1;
+        }
+        STATS_CALL(CALL_LSEEK);
+        if (lseek(src, data, SEEK_SET) < 0) {
+            return -1;
+        }
+        STATS_CALL(CALL_LSEEK);
+        if (lseek(dest, data, SEEK_SET) < 0) {
+            return -1;
+        }
+
+        // A target that already had contents must not keep them where the source has a hole.
+        if (data > pos && dest_st.st_size > pos) {
+            fallocate(dest, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, data - pos);
+        }
+
+        off_t moved = 0;
+        result = copy_data(src, dest, hole - data, method, &moved);
+        total += moved;
+        if (result < 0) {
+            *copied = total;
+            return -1;
+        }
+        pos = hole;
+    }
+
+    if (pos < st.st_size && dest_st.st_size > pos) {
+        fallocate(dest, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, dest_st.st_size - pos);
+    }
+
+    // Extend over a trailing hole, which no write has reached.
+    STATS_CALL(CALL_SETATTR);
+    if (ftruncate(dest, st.st_size) != 0) {
+        return -1;
+    }
+    if (result < 0) {
+        result = copy_data(src, dest, 0, method, NULL);
+    }
+    *copied = total;
+    return result;
+}
+
+// Read up to count bytes at off, stopping early only at end of file.
+static ssize_t pread_full( int fd, char *buf, size_t count, off_t off )
+{
+    size_t got = 0;
+    while (got < count) {
+        STATS_CALL(CALL_READ);
+        ssize_t n = pread(fd, buf + got, count - got, off + got);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        got += n;
+    }
+    return got;
+}
+
+/*
+Both files are local, so each block is compared directly instead of through
+rsync-style rolling checksums, which only pay off when one side is remote.
+*/
+int copy_delta( int src, int dest, off_t *written )
+{
+    char *buffer = buffer_get(2 * DELTA_BLOCK);
+    char *old = buffer + DELTA_BLOCK;
+    off_t pos = 0;
+
+    *written = 0;
+    if (!buffer) {
+        return -1;
+    }
+    posix_fadvise(src, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(dest, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    while (1) {
+        ssize_t n = pread_full(src, buffer, DELTA_BLOCK, pos);
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+
+        ssize_t m = pread_full(dest, old, n, pos);
+        if (m < 0) {
+            return -1;
+        }
+        if (m != n || memcmp(buffer, old, n) != 0) {
+            for (ssize_t done = 0; done < n; ) {
+                STATS_CALL(CALL_WRITE);
+                ssize_t w = pwrite(dest, buffer + done, n - done, pos + done);
+                if (w < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (w <= 0) {
+                    if (w == 0) {
+                        errno = EIO;
+                    }
+                    return -1;
+                }
+                done += w;
+            }
+            *written += n;
+        }
+        pos += n;
+        STATS_BYTES(n);
+    }
+
+    return ftruncate(dest, pos);
+}
@@ -0,0 +1,97 @@
+#ifndef COPYENGINE_H
+#define COPYENGINE_H
+
+#include <sys/types.h>
+
+/** Ways of moving file data, in the order the automatic engine tries them. */
+enum copy_method {
+    COPY_AUTO = -1,
+    COPY_RANGE = 0,     // copy_file_range(): in-kernel, may reflink or copy server-side
+    COPY_SENDFILE,      // sendfile(): page cache straight into the target
+    COPY_SPLICE,        // splice() through a pipe
+    COPY_URING,         // io_uring with a queue of linked read/write pairs
+    COPY_MMAP,          // write() straight from sliding mmap() windows of the source
+    COPY_BUFFERED,      // read()/write() through a user-space buffer
+    COPY_METHOD_COUNT
+};
+
+/** Return the short name of a copy method, as accepted by copy_method_parse(). */
+const char *copy_method_name( int method );
+
+/** Parse a copy method name ("auto" included); returns -2 if the name is unknown. */
+int copy_method_parse( const char *name );
+
+/**
+Copy len bytes (or everything up to end of file if len < 0) from the current
+offset of src to the current offset of dest.  Starting from method, each
+method is tried in turn and the next one takes over from wherever the previous
+one stopped when the kernel refuses it for this pair of files.  COPY_AUTO
+starts with the fastest.  On success returns the method that finished the copy
+and stores the byte count in *copied; on failure returns -1 with errno set.
+*/
+int copy_data( int src, int dest, off_t len, int method, off_t *copied );
+
+/**
+Copy the whole of src into dest from offset 0, like copy_data(), but copy
+only the data extents of a sparse source (found with SEEK_DATA/SEEK_HOLE) and
+leave holes in dest.  *copied gets the data bytes moved and *logical the file
+size, which differ by the size of the holes.
+*/
+int copy_sparse( int src, int dest, int method, off_t *copied, off_t *logical );
+
+/**
+Bring an existing dest up to date with src in place: compare the two files
+block by block, rewrite only the blocks that differ and truncate dest to the
+size of src.  *written gets the number of bytes rewritten.  Returns 0 on
+success or -1 with errno set.
+*/
+int copy_delta( int src, int dest, off_t *written );
+
+/**
+Make read/write copies use O_DIRECT with page-aligned buffers, bypassing the
+page cache.  Other methods go through the cache, so copy_data() then always
+uses COPY_BUFFERED.  Filesystems that refuse O_DIRECT get a normal copy.
+*/
+void copy_set_direct( int on );
+
+/** Options for the COPY_MMAP windows, see copy_set_mmap_flags(). */
+#define COPY_MMAP_POPULATE 1    // prefault each window with MAP_POPULATE
+#define COPY_MMAP_HUGEPAGE 2    // ask for transparent huge pages with MADV_HUGEPAGE
+
+void copy_set_mmap_flags( int flags );
+
+/** Set the io_uring queue depth and registered buffer count.  Call before the first copy. */
+void copy_uring_configure( int depth, int buffers );
+
+/** Size of each registered io_uring buffer; files up to this size can be batched. */
+off_t copy_uring_block_size( void );
+
+/** Number of files copy_uring_batch() accepts at once. */
+int copy_uring_batch_size( void );
+
+/** One small file to be copied by copy_uring_batch(). */
+struct copy_request {
+    int src_dir;        // directories the paths are relative to, or AT_FDCWD
+    int dest_dir;
+    const char *src_path;
+    const char *dest_path;
+    off_t size;         // from the tree walk's stat(), at most copy_uring_block_size()
+    int temporary;      // dest_path is a new temporary name, created with O_EXCL rather than truncated
+    int result;         // set to 0 on success or a negative errno
+};
+
+/**
+Copy up to copy_uring_batch_size() small files, with their opens, reads,
+writes and closes batched into a couple of io_uring submissions.  Returns -1
+if io_uring is unavailable; otherwise each request's result says whether that
+file still has to be copied some other way.
+*/
+int copy_uring_batch( struct copy_request *reqs, int n );
+
+/** Report the I/O operations completed and bytes written through io_uring so far. */
+void copy_uring_totals( long long *ios, long long *bytes );
+
+/** Tear down the calling thread's io_uring instance, if it has one. */
+void copy_uring_release( void );
+
+#endif
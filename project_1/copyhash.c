@@ -0,0 +1,225 @@
+#include <string.h>
+#include <stdint.h>
+
+// The crc32 instruction, 8 bytes at a time, needs x86-64; elsewhere the table does it all.
+#if defined(__x86_64__)
+#define CRC_HARDWARE
+#include <nmmintrin.h>
+#endif
+
+#include "copyhash.h"
+
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+
+static const char *hash_names[HASH_COUNT] = { "crc32c", "xxh64" };
+
+static uint32_t crc_table[256];
+static int crc_hardware = -1;
+
+const char *hash_name( int kind )
+{
+    return hash_names[kind];
+}
+
+int hash_parse( const char *name )
+{
+    for (int i = 0; i < HASH_COUNT; i++) {
+        if (strcmp(name, hash_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int hash_digits( int kind )
+{
+    return kind == HASH_CRC32C ? 8 : 16;
+}
+
+static uint64_t read64( const unsigned char *p )
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t read32( const unsigned char *p )
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t rotl64( uint64_t x, int r )
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static void crc_table_init( void )
+{
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? (c >> 1) ^ 0x82F63B78 : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32c_table( uint32_t crc, const unsigned char *p, size_t len )
+{
+    while (len--) {
+        crc = crc_table[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef CRC_HARDWARE
+
+// Eight bytes per crc32 instruction; the bytes before and after go one at a time.
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42( uint32_t crc, const unsigned char *p, size_t len )
+{
+    uint64_t c = crc;
+
+    while (len >= 8) {
+        c = _mm_crc32_u64(c, read64(p));
+        p += 8;
+        len -= 8;
+    }
+    while (len--) {
+        c = _mm_crc32_u8((uint32_t)c, *p++);
+    }
+    return (uint32_t)c;
+}
+
+#else
+
+// Never called here: crc_hardware stays 0.
+#define crc32c_sse42 crc32c_table
+
+#endif
+
+static uint64_t xxh64_round( uint64_t acc, uint64_t input )
+{
+    acc += input * PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME64_1;
+}
+
+static uint64_t xxh64_merge( uint64_t acc, uint64_t lane )
+{
+    acc ^= xxh64_round(0, lane);
+    return acc * PRIME64_1 + PRIME64_4;
+}
+
+// Consume whole 32-byte stripes, one 8-byte word into each of the four lanes.
+static const unsigned char *xxh64_stripes( uint64_t *lanes, const unsigned char *p, const unsigned char *end )
+{
+    while (p + 32 <= end) {
+        lanes[0] = xxh64_round(lanes[0], read64(p));
+        lanes[1] = xxh64_round(lanes[1], read64(p + 8));
+        lanes[2] = xxh64_round(lanes[2], read64(p + 16));
+        lanes[3] = xxh64_round(lanes[3], read64(p + 24));
+        p += 32;
+    }
+    return p;
+}
+
+void hash_init( struct hash_state *h, int kind )
+{
+    memset(h, 0, sizeof(*h));
+    h->kind = kind;
+
+    if (kind == HASH_CRC32C) {
+        if (crc_hardware < 0) {
+            crc_table_init();
+#ifdef CRC_HARDWARE
+            crc_hardware = __builtin_cpu_supports("sse4.2");
+#else
+            crc_hardware = 0;
+#endif
+        }
+        h->crc = 0xFFFFFFFF;
+    } else {
+        h->lanes[0] = PRIME64_1 + PRIME64_2;
+        h->lanes[1] = PRIME64_2;
+        h->lanes[2] = 0;
+        h->lanes[3] = -PRIME64_1;
+    }
+}
+
+void hash_update( struct hash_state *h, const void *data, size_t len )
+{
+    const unsigned char *p = data;
+    const unsigned char *end = p + len;
+
+    h->total += len;
+    if (h->kind == HASH_CRC32C) {
+        h->crc = crc_hardware ? crc32c_sse42(h->crc, p, len) : crc32c_table(h->crc, p, len);
+        return;
+    }
+
+    // Top up a partial stripe left over from the last call first.
+    if (h->pending_len + len < 32) {
+        memcpy(h->pending + h->pending_len, p, len);
+        h->pending_len += len;
+        return;
+    }
+    if (h->pending_len) {
+        size_t fill = 32 - h->pending_len;
+        memcpy(h->pending + h->pending_len, p, fill);
+        xxh64_stripes(h->lanes, h->pending, h->pending + 32);
+        p += fill;
+        h->pending_len = 0;
+    }
+
+    p = xxh64_stripes(h->lanes, p, end);
+    h->pending_len = end - p;
+    memcpy(h->pending, p, h->pending_len);
+}
+
+uint64_t hash_final( struct hash_state *h )
+{
+    if (h->kind == HASH_CRC32C) {
+        return h->crc ^ 0xFFFFFFFF;
+    }
+
+    uint64_t acc;
+    if (h->total >= 32) {
+        acc = rotl64(h->lanes[0], 1) + rotl64(h->lanes[1], 7) + rotl64(h->lanes[2], 12) + rotl64(h->lanes[3], 18);
+        for (int i = 0; i < 4; i++) {
+            acc = xxh64_merge(acc, h->lanes[i]);
+        }
+    } else {
+        acc = h->lanes[2] + PRIME64_5;
+    }
+    acc += h->total;
+
+    const unsigned char *p = h->pending;
+    const unsigned char *end = p + h->pending_len;
+    for (; p + 8 <= end; p += 8) {
+        acc ^= xxh64_round(0, read64(p));
+        acc = rotl64(acc, 27) * PRIME64_1 + PRIME64_4;
+    }
+    if (p + 4 <= end) {
+        acc ^= read32(p) * PRIME64_1;
+        acc = rotl64(acc, 23) * PRIME64_2 + PRIME64_3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        acc ^= *p * PRIME64_5;
+        acc = rotl64(acc, 11) * PRIME64_1;
+    }
+
+    acc ^= acc >> 33;
+    acc *= PRIME64_2;
+    acc ^= acc >> 29;
+    acc *= PRIME64_3;
+    acc ^= acc >> 32;
+    return acc;
+}
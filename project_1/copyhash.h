@@ -0,0 +1,37 @@
+#ifndef COPYHASH_H
+#define COPYHASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Checksums the copy pipeline can compute on the fly. */
+enum hash_kind {
+    HASH_CRC32C,        // CRC-32C, with the SSE4.2 crc32 instruction where the CPU has it
+    HASH_XXH64,         // xxHash64
+    HASH_COUNT
+};
+
+/** A checksum being computed over a stream of bytes. */
+struct hash_state {
+    int kind;
+    uint32_t crc;
+    uint64_t lanes[4];  // xxHash64 accumulators
+    uint64_t total;
+    unsigned char pending[32];
+    unsigned pending_len;
+};
+
+/** Return the name of a checksum, as accepted by hash_parse(). */
+const char *hash_name( int kind );
+
+/** Parse a checksum name; returns -1 if the name is unknown. */
+int hash_parse( const char *name );
+
+/** Number of hex digits in a printed checksum of this kind. */
+int hash_digits( int kind );
+
+void hash_init( struct hash_state *h, int kind );
+void hash_update( struct hash_state *h, const void *data, size_t len );
+uint64_t hash_final( struct hash_state *h );
+
+#endif
@@ -4,13 +4,10 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <string.h>
-#include <signal.h>
+#include <sys/stat.h>
 
-// Function to display a periodic "still copying" message.
-void display_message(int s) {
-    printf("copyit: still copying...\n");
-    alarm(1);  // Reset the alarm for another second
-}
+#include "copyengine.h"
+#include "copystats.h"
 
 int main(int argc, char *argv[]) {
     if (argc != 3) {
@@ -19,10 +16,6 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
-    // Set up the handler for the SIGALRM signal
-    signal(SIGALRM, display_message);
-    alarm(1);  // Set the initial alarm for one second
-
     int src = open(argv[1], O_RDONLY);
     if (src < 0) {
         printf("copyit: Couldn't open source file %s: %s\n", argv[1], strerror(errno));
@@ -44,46 +37,28 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
 
-    char buffer[4096];
-    ssize_t bytes_read, bytes_written, total_bytes = 0;
-
-    // Begin the file copy process
-    while (1) {
-        do {
-            bytes_read = read(src, buffer, sizeof(buffer));
-        } while (bytes_read < 0 && errno == EINTR);  // Retry if read is interrupted
-
-        if (bytes_read < 0) {
-            printf("copyit: Error reading from %s: %s\n", argv[1], strerror(errno));
-            break;
-        }
-
-        if (bytes_read == 0) {
-            break;  // End of file reached
-        }
-
-        char *ptr = buffer;
-        while (bytes_read > 0) {
-            do {
-                bytes_written = write(dest, ptr, bytes_read);
-            } while (bytes_written < 0 && errno == EINTR);  // Retry if write is interrupted
-
-            if (bytes_written <= 0) {
-                printf("copyit: Error writing to %s: %s\n", argv[2], strerror(errno));
-                close(src);
-                close(dest);
-                exit(1);
-            }
+    // Report progress once a second from a separate thread
+    struct stat st;
+    if (fstat(src, &st) == 0 && S_ISREG(st.st_mode)) {
+        stats_expect(1, st.st_size);
+    }
+    stats_start_reporter("copyit");
 
-            total_bytes += bytes_written;
-            bytes_read -= bytes_written;
-            ptr += bytes_written;
-        }
+    // Move the data, letting the kernel do the copy whenever it can and
+    // skipping the holes of a sparse file
+    off_t total_bytes = 0, data_bytes = 0;
+    int method = copy_sparse(src, dest, COPY_AUTO, &data_bytes, &total_bytes);
+    stats_stop_reporter();
+    if (method < 0) {
+        printf("copyit: Error copying %s to %s: %s\n", argv[1], argv[2], strerror(errno));
+        close(src);
+        close(dest);
+        exit(1);
     }
 
     // Clean up: Close open files and report success
     close(src);
     close(dest);
-    printf("copyit: Copied %lld bytes from file %s to %s.\n", (long long)total_bytes, argv[1], argv[2]);
+    printf("copyit: Copied %lld bytes from file %s to %s (%lld bytes of data, %s).\n", (long long)total_bytes, argv[1], argv[2], (long long)data_bytes, copy_method_name(method));
     return 0;
 }
@@ -0,0 +1,489 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "copypipe.h"
+#include "copyhash.h"
+#include "copystats.h"
+
+#define PIPE_BUFFER (1024 * 1024)
+#define PIPE_BUFFERS 8
+#define SPIN_LIMIT 200
+#define HOLE_BLOCK 4096
+
+enum { BUF_DATA, BUF_LAST, BUF_STOP };
+
+struct pipe_buf {
+    int kind;           // BUF_LAST carries the file's final (possibly empty) data
+    char *data;
+    size_t len;
+    char *out;          // what the writer writes: data, or its compressed form
+    size_t out_len;
+    int error;          // errno from the checksum stage
+#ifdef HAVE_ZSTD
+    char *packed;
+#endif
+};
+
+/*
+Single-producer, single-consumer ring of buffers.  It has room for every
+buffer at once, so a push never waits; a pop spins briefly and then sleeps
+on a futex until the producer publishes a new tail.
+*/
+struct ring {
+    atomic_uint head;
+    atomic_uint tail;
+    atomic_int sleeping;
+    struct pipe_buf *slots[PIPE_BUFFERS + 1];
+};
+
+/*
+One thread's pipeline: the thread itself reads, and hands buffers to the
+hasher, which hands them to the writer, which hands them back.  The file
+being copied is set up before its first buffer goes in and inspected after
+its last one comes back, so the rings order every access to it.
+*/
+struct pipeline {
+    struct ring to_hash;
+    struct ring to_write;
+    struct ring returned;
+    struct pipe_buf bufs[PIPE_BUFFERS];
+    struct pipe_buf stop;
+    pthread_t hasher;
+    pthread_t writer;
+    int dest;
+    int error;          // errno of the first failed write
+    off_t written;
+    off_t offset;       // where the next write goes, past any holes skipped
+    int in_hole;        // the last block was skipped, so the end still has to be set
+    struct hash_state hash;
+#ifdef HAVE_ZSTD
+    ZSTD_CCtx *zstd;
+#endif
+};
+
+static int pipe_hash = HASH_CRC32C;
+static int pipe_level;
+static __thread struct pipeline *thread_pipeline;
+
+int copy_pipeline_configure( int hash_kind, int compress_level )
+{
+    pipe_hash = hash_kind;
+    pipe_level = compress_level;
+#ifndef HAVE_ZSTD
+    if (compress_level > 0) {
+        return -1;
+    }
+#endif
+    return 0;
+}
+
+static void ring_push( struct ring *r, struct pipe_buf *b )
+{
+    unsigned tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    r->slots[tail % (PIPE_BUFFERS + 1)] = b;
+    atomic_store(&r->tail, tail + 1);
+    if (atomic_load(&r->sleeping)) {
+        syscall(SYS_futex, &r->tail, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+static struct pipe_buf *ring_pop( struct ring *r )
+{
+    unsigned head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+    for (int spins = 0; atomic_load_explicit(&r->tail, memory_order_acquire) == head; spins++) {
+        if (spins < SPIN_LIMIT) {
+            continue;
+        }
+        atomic_store(&r->sleeping, 1);
+        if (atomic_load(&r->tail) == head) {
+            syscall(SYS_futex, &r->tail, FUTEX_WAIT_PRIVATE, head, NULL, NULL, 0);
+        }
+        atomic_store(&r->sleeping, 0);
+    }
+
+    struct pipe_buf *b = r->slots[head % (PIPE_BUFFERS + 1)];
+    atomic_store_explicit(&r->head, head + 1, memory_order_release);
+    return b;
+}
+
+static int write_all( int fd, const char *data, size_t len )
+{
+    while (len > 0) {
+        STATS_CALL(CALL_WRITE);
+        ssize_t n = write(fd, data, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        data += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int is_zero( const char *data, size_t len )
+{
+    return len == 0 || (data[0] == 0 && memcmp(data, data + 1, len - 1) == 0);
+}
+
+/*
+Write len bytes at the destination's current offset, seeking over any whole
+blocks of zeros instead, so that holes in the source stay holes.
+*/
+static int write_sparse( struct pipeline *p, const char *data, size_t len )
+{
+    size_t pos = 0;
+
+    while (pos < len) {
+        size_t run = len - pos < HOLE_BLOCK ? len - pos : HOLE_BLOCK;
+        int zero = is_zero(data + pos, run);
+        // Gather every following block of the same kind into one write or seek.
+        while (pos + run < len) {
+            size_t next = len - pos - run < HOLE_BLOCK ? len - pos - run : HOLE_BLOCK;
+            if (is_zero(data + pos + run, next) != zero) {
+                break;
+            }
+            run += next;
+        }
+
+        if (zero) {
+            STATS_CALL(CALL_LSEEK);
+            if (lseek(p->dest, run, SEEK_CUR) < 0) {
+                return -1;
+            }
+        } else {
+            if (write_all(p->dest, data + pos, run) != 0) {
+                return -1;
+            }
+            p->written += run;
+            STATS_BYTES(run);
+        }
+        p->in_hole = zero;
+        p->offset += run;
+        pos += run;
+    }
+    return 0;
+}
+
+static void stage_hash( struct pipeline *p, struct pipe_buf *b )
+{
+    hash_update(&p->hash, b->data, b->len);
+    b->out = b->data;
+    b->out_len = b->len;
+    b->error = 0;
+
+#ifdef HAVE_ZSTD
+    // Each buffer becomes its own frame; concatenated frames are still one valid zstd stream.
+    if (pipe_level > 0 && b->len > 0) {
+        size_t n = ZSTD_compressCCtx(p->zstd, b->packed, ZSTD_compressBound(PIPE_BUFFER), b->data, b->len, pipe_level);
+        if (ZSTD_isError(n)) {
+            b->error = EIO;
+        } else {
+            b->out = b->packed;
+            b->out_len = n;
+        }
+    }
+#endif
+}
+
+static void stage_write( struct pipeline *p, struct pipe_buf *b )
+{
+    if (b->error && !p->error) {
+        p->error = b->error;
+    }
+    if (p->error || b->out_len == 0) {
+        return;
+    }
+    // Compressed output is never written sparse; zstd already shrinks runs of zeros.
+    if (b->out == b->data) {
+        if (write_sparse(p, b->out, b->out_len) != 0) {
+            p->error = errno ? errno : EIO;
+        }
+        return;
+    }
+    if (write_all(p->dest, b->out, b->out_len) != 0) {
+        p->error = errno ? errno : EIO;
+        return;
+    }
+    p->written += b->out_len;
+    p->offset += b->out_len;
+    p->in_hole = 0;
+    STATS_BYTES(b->out_len);
+}
+
+static void *hasher_main( void *arg )
+{
+    struct pipeline *p = arg;
+    struct pipe_buf *b;
+
+    do {
+        b = ring_pop(&p->to_hash);
+        if (b->kind != BUF_STOP) {
+            stage_hash(p, b);
+        }
+        ring_push(&p->to_write, b);
+    } while (b->kind != BUF_STOP);
+    return NULL;
+}
+
+static void *writer_main( void *arg )
+{
+    struct pipeline *p = arg;
+
+    while (1) {
+        struct pipe_buf *b = ring_pop(&p->to_write);
+        if (b->kind == BUF_STOP) {
+            return NULL;
+        }
+        stage_write(p, b);
+        ring_push(&p->returned, b);
+    }
+}
+
+static void pipeline_free( struct pipeline *p )
+{
+    for (int i = 0; i < PIPE_BUFFERS; i++) {
+        free(p->bufs[i].data);
+#ifdef HAVE_ZSTD
+        free(p->bufs[i].packed);
+#endif
+    }
+#ifdef HAVE_ZSTD
+    ZSTD_freeCCtx(p->zstd);
+#endif
+    free(p);
+}
+
+static struct pipeline *pipeline_get( void )
+{
+    if (thread_pipeline) {
+        return thread_pipeline;
+    }
+
+    struct pipeline *p = calloc(1, sizeof(*p));
+    if (!p) {
+        return NULL;
+    }
+    for (int i = 0; i < PIPE_BUFFERS; i++) {
+        if (posix_memalign((void **)&p->bufs[i].data, 4096, PIPE_BUFFER) != 0) {
+            goto fail;
+        }
+#ifdef HAVE_ZSTD
+        if (pipe_level > 0 && !(p->bufs[i].packed = malloc(ZSTD_compressBound(PIPE_BUFFER)))) {
+            goto fail;
+        }
+#endif
+    }
+#ifdef HAVE_ZSTD
+    if (pipe_level > 0 && !(p->zstd = ZSTD_createCCtx())) {
+        goto fail;
+    }
+#endif
+    p->stop.kind = BUF_STOP;
+
+    if (pthread_create(&p->hasher, NULL, hasher_main, p) != 0) {
+        goto fail;
+    }
+    if (pthread_create(&p->writer, NULL, writer_main, p) != 0) {
+        ring_push(&p->to_hash, &p->stop);
+        pthread_join(p->hasher, NULL);
+        goto fail;
+    }
+
+    thread_pipeline = p;
+    return p;
+
+fail:
+    pipeline_free(p);
+    errno = ENOMEM;
+    return NULL;
+}
+
+static ssize_t read_full( int fd, char *data, size_t len )
+{
+    size_t done = 0;
+    while (done < len) {
+        STATS_CALL(CALL_READ);
+        ssize_t n = read(fd, data + done, len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        done += n;
+    }
+    return done;
+}
+
+int copy_pipeline( int src, int dest, off_t size_hint, off_t *copied, off_t *logical, uint64_t *sum )
+{
+    struct pipeline *p = pipeline_get();
+    struct pipe_buf *spare[PIPE_BUFFERS];
+    int nspare = 0, outstanding = 0, read_error = 0;
+    off_t total = 0;
+
+    if (!p) {
+        return -1;
+    }
+    for (int i = 0; i < PIPE_BUFFERS; i++) {
+        spare[nspare++] = &p->bufs[i];
+    }
+
+    p->dest = dest;
+    p->error = 0;
+    p->written = 0;
+    p->offset = 0;
+    p->in_hole = 0;
+    hash_init(&p->hash, pipe_hash);
+
+    // Handing a file that fits in one buffer between threads would only add latency.
+    int inline_copy = size_hint < PIPE_BUFFER;
+
+    while (1) {
+        if (nspare == 0) {
+            spare[nspare++] = ring_pop(&p->returned);
+            outstanding--;
+        }
+        struct pipe_buf *b = spare[--nspare];
+
+        ssize_t n = read_full(src, b->data, PIPE_BUFFER);
+        if (n < 0) {
+            read_error = errno;
+            n = 0;
+        }
+        b->len = n;
+        b->kind = n < PIPE_BUFFER ? BUF_LAST : BUF_DATA;
+        total += n;
+
+        if (inline_copy) {
+            stage_hash(p, b);
+            stage_write(p, b);
+            spare[nspare++] = b;
+        } else {
+            ring_push(&p->to_hash, b);
+            outstanding++;
+        }
+        if (b->kind == BUF_LAST) {
+            break;
+        }
+    }
+
+    // Wait for the writer to hand every buffer back.
+    while (outstanding > 0) {
+        ring_pop(&p->returned);
+        outstanding--;
+    }
+
+    // A trailing hole was only seeked over, so nothing has set the file's length yet.
+    if (!read_error && !p->error && p->in_hole) {
+        STATS_CALL(CALL_SETATTR);
+        if (ftruncate(dest, p->offset) != 0) {
+            p->error = errno;
+        }
+    }
+
+    if (read_error || p->error) {
+        errno = read_error ? read_error : p->error;
+        return -1;
+    }
+    *copied = p->written;
+    *logical = total;
+    *sum = hash_final(&p->hash);
+    return 0;
+}
+
+void copy_pipeline_release( void )
+{
+    struct pipeline *p = thread_pipeline;
+
+    if (p) {
+        ring_push(&p->to_hash, &p->stop);
+        pthread_join(p->hasher, NULL);
+        pthread_join(p->writer, NULL);
+        pipeline_free(p);
+        thread_pipeline = NULL;
+    }
+}
+
+int copy_pipeline_checksum( int fd, int compressed, off_t *size, uint64_t *sum )
+{
+    struct hash_state h;
+    off_t total = 0;
+    char *data = malloc(PIPE_BUFFER);
+    ssize_t n;
+
+    if (!data) {
+        return -1;
+    }
+    hash_init(&h, pipe_hash);
+
+#ifdef HAVE_ZSTD
+    if (compressed) {
+        ZSTD_DCtx *dctx = ZSTD_createDCtx();
+        char *plain = malloc(PIPE_BUFFER);
+        int result = dctx && plain ? 0 : -1;
+
+        while (result == 0 && (n = read_full(fd, data, PIPE_BUFFER)) > 0) {
+            ZSTD_inBuffer in = { data, n, 0 };
+            int full;
+            // A full output buffer may mean the decoder is still holding data back.
+            do {
+                ZSTD_outBuffer out = { plain, PIPE_BUFFER, 0 };
+                if (ZSTD_isError(ZSTD_decompressStream(dctx, &out, &in))) {
+                    errno = EIO;
+                    result = -1;
+                    break;
+                }
+                hash_update(&h, plain, out.pos);
+                total += out.pos;
+                full = out.pos == out.size;
+            } while (in.pos < in.size || full);
+        }
+        if (n < 0) {
+            result = -1;
+        }
+        ZSTD_freeDCtx(dctx);
+        free(plain);
+        free(data);
+        *size = total;
+        *sum = hash_final(&h);
+        return result;
+    }
+#else
+    if (compressed) {
+        free(data);
+        errno = ENOTSUP;
+        return -1;
+    }
+#endif
+
+    while ((n = read_full(fd, data, PIPE_BUFFER)) > 0) {
+        hash_update(&h, data, n);
+        total += n;
+    }
+    free(data);
+    if (n < 0) {
+        return -1;
+    }
+    *size = total;
+    *sum = hash_final(&h);
+    return 0;
+}
@@ -0,0 +1,34 @@
+#ifndef COPYPIPE_H
+#define COPYPIPE_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/**
+Choose the checksum (a hash_kind) computed by copy_pipeline(), and the zstd
+level its output is compressed with, 0 for none.  Returns -1 if compression
+was asked for but copyit was built without zstd (make ZSTD=1).
+*/
+int copy_pipeline_configure( int hash_kind, int compress_level );
+
+/**
+Copy all of src to dest through the calling thread's pipeline: this thread
+reads, a second thread checksums (and compresses) and a third writes, with
+buffers handed between them on lock-free rings so that all three overlap.
+Uncompressed copies skip whole blocks of zeros, leaving holes in dest.
+Files smaller than size_hint says fit in one buffer are done inline.
+*copied gets the bytes written (not counting holes), *logical the bytes read and *sum the checksum
+of what was read.  Returns 0, or -1 with errno set.
+*/
+int copy_pipeline( int src, int dest, off_t size_hint, off_t *copied, off_t *logical, uint64_t *sum );
+
+/** Stop the calling thread's pipeline threads, if it has any. */
+void copy_pipeline_release( void );
+
+/**
+Checksum the contents of fd, decompressing them first if compressed, for
+checking a copy against its manifest.  *size gets the (uncompressed) length.
+*/
+int copy_pipeline_checksum( int fd, int compressed, off_t *size, uint64_t *sum );
+
+#endif
@@ -0,0 +1,215 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "copystats.h"
+
+__thread struct copy_counters *thread_counters;
+
+// Every thread's counters, newest first.  Counters outlive their threads so
+// nothing is lost from the totals.
+static struct copy_counters *all_counters;
+static pthread_mutex_t counters_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Work expected in total, once known (from stats_expect or the pre-scan).
+static atomic_llong expected_files;
+static atomic_llong expected_bytes;
+static atomic_int expected_known;
+
+static pthread_t scan_thread;
+static int scan_running;
+static atomic_int scan_cancel;
+static long long scan_files, scan_bytes;
+
+static pthread_t reporter_thread;
+static int reporter_running;
+static int reporter_stop;
+static const char *reporter_prefix;
+static pthread_mutex_t reporter_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reporter_cond;
+
+static const char *phase_names[PHASE_COUNT] = {
+    "stat", "open", "data", "fsync"
+};
+
+static const char *call_names[CALL_COUNT] = {
+    "stat", "open", "close", "mkdir", "lseek", "read", "write",
+    "copy_file_range", "sendfile", "splice", "io_uring_enter", "mmap", "fsync",
+    "getdents64", "link", "setattr"
+};
+
+const char *stats_phase_name( int phase )
+{
+    return phase_names[phase];
+}
+
+const char *stats_call_name( int call )
+{
+    return call_names[call];
+}
+
+struct copy_counters *stats_register( void )
+{
+    struct copy_counters *c = calloc(1, sizeof(*c));
+    if (!c) {
+        perror("copyit: Out of memory");
+        exit(1);
+    }
+
+    pthread_mutex_lock(&counters_lock);
+    c->next = all_counters;
+    all_counters = c;
+    pthread_mutex_unlock(&counters_lock);
+
+    thread_counters = c;
+    return c;
+}
+
+long long stats_now( void )
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void stats_phase( int phase, long long start )
+{
+    stats_add(&stats_local()->phase_ns[phase], stats_now() - start);
+}
+
+void stats_totals( struct copy_totals *t )
+{
+    memset(t, 0, sizeof(*t));
+
+    pthread_mutex_lock(&counters_lock);
+    for (struct copy_counters *c = all_counters; c; c = c->next) {
+        t->bytes += atomic_load_explicit(&c->bytes, memory_order_relaxed);
+        t->files += atomic_load_explicit(&c->files, memory_order_relaxed);
+        for (int i = 0; i < PHASE_COUNT; i++) {
+            t->phase_ns[i] += atomic_load_explicit(&c->phase_ns[i], memory_order_relaxed);
+        }
+        for (int i = 0; i < CALL_COUNT; i++) {
+            t->calls[i] += atomic_load_explicit(&c->calls[i], memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&counters_lock);
+}
+
+void stats_expect( long long files, long long bytes )
+{
+    atomic_store(&expected_files, files);
+    atomic_store(&expected_bytes, bytes);
+    atomic_store(&expected_known, 1);
+}
+
+static int scan_entry( const char *path, const struct stat *st, int type, struct FTW *ftw )
+{
+    if (type == FTW_F && S_ISREG(st->st_mode)) {
+        scan_files++;
+        scan_bytes += st->st_size;
+    }
+    return atomic_load(&scan_cancel);
+}
+
+static void *scan_main( void *arg )
+{
+    char *path = arg;
+    if (nftw(path, scan_entry, 64, FTW_PHYS) == 0) {
+        stats_expect(scan_files, scan_bytes);
+    }
+    free(path);
+    return NULL;
+}
+
+void stats_prescan( const char *path )
+{
+    char *copy = strdup(path);
+    if (copy && pthread_create(&scan_thread, NULL, scan_main, copy) == 0) {
+        scan_running = 1;
+    } else {
+        free(copy);
+    }
+}
+
+static void print_progress( double elapsed, double interval, long long bytes, long long last_bytes, long long files )
+{
+    double avg = elapsed > 0 ? bytes / elapsed / 1e6 : 0;
+    double now = interval > 0 ? (bytes - last_bytes) / interval / 1e6 : 0;
+
+    if (!atomic_load(&expected_known)) {
+        printf("%s: %lld files, %.1f MB, %.1f MB/s now, %.1f MB/s avg, ETA unknown (scanning)\n",
+               reporter_prefix, files, bytes / 1e6, now, avg);
+        return;
+    }
+
+    long long total = atomic_load(&expected_bytes);
+    double left = total > bytes ? (total - bytes) / 1e6 : 0;
+    printf("%s: %lld/%lld files, %.1f/%.1f MB, %.1f MB/s now, %.1f MB/s avg, ETA %.0fs\n",
+           reporter_prefix, files, (long long)atomic_load(&expected_files), bytes / 1e6, total / 1e6,
+           now, avg, avg > 0 ? left / avg : 0);
+}
+
+static void *reporter_main( void *arg )
+{
+    long long start = stats_now();
+    long long last = start;
+    long long last_bytes = 0;
+    struct timespec deadline;
+    struct copy_totals t;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    pthread_mutex_lock(&reporter_lock);
+    while (!reporter_stop) {
+        deadline.tv_sec++;
+        while (!reporter_stop && pthread_cond_timedwait(&reporter_cond, &reporter_lock, &deadline) != ETIMEDOUT) {
+        }
+        if (reporter_stop) {
+            break;
+        }
+
+        long long now = stats_now();
+        stats_totals(&t);
+        print_progress((now - start) / 1e9, (now - last) / 1e9, t.bytes, last_bytes, t.files);
+        fflush(stdout);
+        last = now;
+        last_bytes = t.bytes;
+    }
+    pthread_mutex_unlock(&reporter_lock);
+    return NULL;
+}
+
+void stats_start_reporter( const char *prefix )
+{
+    pthread_condattr_t attr;
+
+    reporter_prefix = prefix;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&reporter_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    reporter_running = pthread_create(&reporter_thread, NULL, reporter_main, NULL) == 0;
+}
+
+void stats_stop_reporter( void )
+{
+    if (reporter_running) {
+        pthread_mutex_lock(&reporter_lock);
+        reporter_stop = 1;
+        pthread_cond_signal(&reporter_cond);
+        pthread_mutex_unlock(&reporter_lock);
+        pthread_join(reporter_thread, NULL);
+        reporter_running = 0;
+    }
+    if (scan_running) {
+        atomic_store(&scan_cancel, 1);
+        pthread_join(scan_thread, NULL);
+        scan_running = 0;
+    }
+}
@@ -0,0 +1,95 @@
+#ifndef COPYSTATS_H
+#define COPYSTATS_H
+
+#include <stdatomic.h>
+
+/** Phases of copying a file, timed separately. */
+enum copy_phase {
+    PHASE_STAT,
+    PHASE_OPEN,
+    PHASE_DATA,
+    PHASE_FSYNC,
+    PHASE_COUNT
+};
+
+/** System calls counted on the copy paths. */
+enum copy_call {
+    CALL_STAT,
+    CALL_OPEN,
+    CALL_CLOSE,
+    CALL_MKDIR,
+    CALL_LSEEK,
+    CALL_READ,
+    CALL_WRITE,
+    CALL_COPY_FILE_RANGE,
+    CALL_SENDFILE,
+    CALL_SPLICE,
+    CALL_IO_URING_ENTER,
+    CALL_MMAP,
+    CALL_FSYNC,
+    CALL_GETDENTS,
+    CALL_LINK,          // link, symlink, readlink and rename
+    CALL_SETATTR,       // chmod, chown, utimens and ftruncate
+    CALL_COUNT
+};
+
+/*
+Counters of one thread.  Only the owning thread writes them, with relaxed
+load/store pairs that compile to plain memory accesses, so the copy loops pay
+no more than for an ordinary increment and never share a cache line with
+another writer.  The reporter thread sums every thread's counters.
+*/
+struct copy_counters {
+    atomic_llong bytes;
+    atomic_llong files;
+    atomic_llong phase_ns[PHASE_COUNT];
+    atomic_llong calls[CALL_COUNT];
+    struct copy_counters *next;
+};
+
+/** Sums of all threads' counters. */
+struct copy_totals {
+    long long bytes;
+    long long files;
+    long long phase_ns[PHASE_COUNT];
+    long long calls[CALL_COUNT];
+};
+
+extern __thread struct copy_counters *thread_counters;
+struct copy_counters *stats_register( void );
+
+static inline struct copy_counters *stats_local( void )
+{
+    return thread_counters ? thread_counters : stats_register();
+}
+
+static inline void stats_add( atomic_llong *counter, long long n )
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+#define STATS_CALL(call)  stats_add(&stats_local()->calls[(call)], 1)
+#define STATS_BYTES(n)    stats_add(&stats_local()->bytes, (n))
+#define STATS_FILE()      stats_add(&stats_local()->files, 1)
+
+/** Monotonic time in nanoseconds. */
+long long stats_now( void );
+
+/** Charge the time since start (from stats_now()) to a phase. */
+void stats_phase( int phase, long long start );
+
+void stats_totals( struct copy_totals *t );
+const char *stats_phase_name( int phase );
+const char *stats_call_name( int call );
+
+/** Set the amount of work expected, for the ETA, when it is already known. */
+void stats_expect( long long files, long long bytes );
+
+/** Count the files and bytes under path on a background thread, for the ETA. */
+void stats_prescan( const char *path );
+
+/** Start (and stop) printing progress once a second, each line starting with prefix. */
+void stats_start_reporter( const char *prefix );
+void stats_stop_reporter( void );
+
+#endif
@@ -0,0 +1,472 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sysmacros.h>
+#include <sys/resource.h>
+
+#include "copytree.h"
+#include "copystats.h"
+
+// Bytes of directory entries fetched per getdents64() call.
+#define READER_BUFFER (32 * 1024)
+
+struct tree_dir tree_cwd = { NULL, AT_FDCWD, AT_FDCWD };
+
+static mode_t saved_umask;
+static int no_statx;
+static int no_tmpfile;
+static atomic_uint temp_counter;
+
+// Hard link map: open hashing on (dev, ino), doubled when it fills up.
+struct link_entry {
+    dev_t dev;
+    ino_t ino;
+    char *path;             // the first copy, once it exists
+    int copying;            // a thread is making the first copy
+    struct link_entry *next;
+};
+
+static struct link_entry **link_table;
+static size_t link_buckets;
+static size_t link_count;
+static pthread_mutex_t links_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t link_copied = PTHREAD_COND_INITIALIZER;
+
+// The kernel's directory entry, as returned by getdents64().
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+
+void tree_init( void )
+{
+    struct rlimit limit;
+
+    saved_umask = umask(0);
+    umask(saved_umask);
+
+    // Every directory on the way down (and, with -j, every directory with
+    // entries still queued) holds two descriptors open.
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+int tree_stat( struct tree_dir *dir, const char *name, int follow, struct stat *st )
+{
+    struct statx sx;
+    int flags = follow ? 0 : AT_SYMLINK_NOFOLLOW;
+    int result;
+
+    long long start = stats_now();
+    STATS_CALL(CALL_STAT);
+    if (!no_statx) {
+        // Only ask for what the copy needs, so no filesystem has to work out a birth time.
+        result = statx(dir->src_fd, name, flags,
+                       STATX_TYPE | STATX_MODE | STATX_NLINK | STATX_UID | STATX_GID |
+                       STATX_INO | STATX_SIZE | STATX_ATIME | STATX_MTIME, &sx);
+        if (result == 0) {
+            memset(st, 0, sizeof(*st));
+            st->st_dev = makedev(sx.stx_dev_major, sx.stx_dev_minor);
+            st->st_ino = sx.stx_ino;
+            st->st_mode = sx.stx_mode;
+            st->st_nlink = sx.stx_nlink;
+            st->st_uid = sx.stx_uid;
+            st->st_gid = sx.stx_gid;
+            st->st_size = sx.stx_size;
+            st->st_atim.tv_sec = sx.stx_atime.tv_sec;
+            st->st_atim.tv_nsec = sx.stx_atime.tv_nsec;
+            st->st_mtim.tv_sec = sx.stx_mtime.tv_sec;
+            st->st_mtim.tv_nsec = sx.stx_mtime.tv_nsec;
+        } else if (errno == ENOSYS) {
+            no_statx = 1;
+        }
+    }
+    if (no_statx) {
+        result = fstatat(dir->src_fd, name, st, flags);
+    }
+    stats_phase(PHASE_STAT, start);
+    return result;
+}
+
+struct tree_dir *tree_open_dir( struct tree_dir *parent, const char *src_name, const char *dest_name, const struct stat *st )
+{
+    struct tree_dir *dir = calloc(1, sizeof(*dir));
+    if (!dir || !(dir->src_name = strdup(src_name)) || !(dir->dest_name = strdup(dest_name))) {
+        perror("copyit: Out of memory");
+        exit(1);
+    }
+
+    // Owner-only until every entry is in, then the source's mode.
+    STATS_CALL(CALL_MKDIR);
+    if (mkdirat(parent->dest_fd, dest_name, 0700) != 0 && errno != EEXIST) {
+        goto fail;
+    }
+
+    // Symlinks below the command-line paths are copied, never followed.
+    int nofollow = parent == &tree_cwd ? 0 : O_NOFOLLOW;
+    long long start = stats_now();
+    STATS_CALL(CALL_OPEN);
+    dir->src_fd = openat(parent->src_fd, src_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC | nofollow);
+    if (dir->src_fd >= 0) {
+        STATS_CALL(CALL_OPEN);
+        dir->dest_fd = openat(parent->dest_fd, dest_name, O_RDONLY | O_DIRECTORY | O_CLOEXEC | nofollow);
+    } else {
+        dir->dest_fd = -1;
+    }
+    stats_phase(PHASE_OPEN, start);
+    if (dir->dest_fd < 0) {
+        int error = errno;
+        if (dir->src_fd >= 0) {
+            STATS_CALL(CALL_CLOSE);
+            close(dir->src_fd);
+        }
+        errno = error;
+        goto fail;
+    }
+
+    dir->parent = parent;
+    dir->st = *st;
+    atomic_init(&dir->refs, 1);
+    tree_hold(parent);
+    return dir;
+
+fail:
+    free(dir->src_name);
+    free(dir->dest_name);
+    free(dir);
+    return NULL;
+}
+
+void tree_hold( struct tree_dir *dir )
+{
+    atomic_fetch_add(&dir->refs, 1);
+}
+
+int tree_release( struct tree_dir *dir )
+{
+    if (!dir->parent || atomic_fetch_sub(&dir->refs, 1) != 1) {
+        return 0;
+    }
+
+    int result = tree_set_attrs(dir->dest_fd, &dir->st, 0);
+    if (result != 0) {
+        perror("copyit: Error setting directory attributes");
+    }
+    STATS_CALL(CALL_CLOSE);
+    close(dir->src_fd);
+    STATS_CALL(CALL_CLOSE);
+    close(dir->dest_fd);
+
+    struct tree_dir *parent = dir->parent;
+    free(dir->src_name);
+    free(dir->dest_name);
+    free(dir);
+
+    if (tree_release(parent) != 0) {
+        result = -1;
+    }
+    return result;
+}
+
+char *tree_path( struct tree_dir *dir, const char *name, int dest )
+{
+    char *path;
+
+    if (!dir->parent) {
+        path = strdup(name);
+    } else {
+        char *prefix = tree_path(dir->parent, dest ? dir->dest_name : dir->src_name, dest);
+        if (asprintf(&path, "%s/%s", prefix, name) < 0) {
+            path = NULL;
+        }
+        free(prefix);
+    }
+    if (!path) {
+        perror("copyit: Out of memory");
+        exit(1);
+    }
+    return path;
+}
+
+void tree_reader_open( struct tree_reader *r, int fd )
+{
+    r->fd = fd;
+    r->pos = 0;
+    r->len = 0;
+    r->error = 0;
+    r->buf = malloc(READER_BUFFER);
+    if (!r->buf) {
+        perror("copyit: Out of memory");
+        exit(1);
+    }
+}
+
+const char *tree_read( struct tree_reader *r )
+{
+    while (1) {
+        if (r->pos >= r->len) {
+            STATS_CALL(CALL_GETDENTS);
+            long n = syscall(SYS_getdents64, r->fd, r->buf, READER_BUFFER);
+            if (n <= 0) {
+                r->error = n < 0 ? errno : 0;
+                return NULL;
+            }
+            r->pos = 0;
+            r->len = n;
+        }
+
+        struct linux_dirent64 *entry = (struct linux_dirent64 *)(r->buf + r->pos);
+        r->pos += entry->d_reclen;
+
+        const char *name = entry->d_name;
+        if (name[0] != '.' || (name[1] && (name[1] != '.' || name[2]))) {
+            return name;
+        }
+    }
+}
+
+void tree_reader_close( struct tree_reader *r )
+{
+    free(r->buf);
+    r->buf = NULL;
+}
+
+// Whether chmod has to follow a create with st's mode (or a chown, which clears set-id bits).
+static int needs_chmod( const struct stat *st, int created, int chowned )
+{
+    return !created || chowned || (st->st_mode & (saved_umask | S_ISUID | S_ISGID | S_ISVTX));
+}
+
+// Whether a new file needs a chown to match st; an existing one always gets one.
+static int needs_chown( const struct stat *st, int created )
+{
+    return !created || st->st_uid != geteuid() || st->st_gid != getegid();
+}
+
+// Only root can give files away, so a refused chown is not an error.
+static int chown_failed( int result )
+{
+    return result != 0 && errno != EPERM && errno != EINVAL;
+}
+
+int tree_set_attrs( int fd, const struct stat *st, int created )
+{
+    struct timespec times[2] = { st->st_atim, st->st_mtim };
+    int chowned = 0;
+
+    if (needs_chown(st, created)) {
+        STATS_CALL(CALL_SETATTR);
+        int result = fchown(fd, st->st_uid, st->st_gid);
+        if (chown_failed(result)) {
+            return -1;
+        }
+        chowned = result == 0;
+    }
+    if (needs_chmod(st, created, chowned)) {
+        STATS_CALL(CALL_SETATTR);
+        if (fchmod(fd, st->st_mode & 07777) != 0) {
+            return -1;
+        }
+    }
+    STATS_CALL(CALL_SETATTR);
+    return futimens(fd, times);
+}
+
+int tree_set_attrs_at( int dirfd, const char *name, const struct stat *st, int created )
+{
+    struct timespec times[2] = { st->st_atim, st->st_mtim };
+    int chowned = 0;
+
+    if (needs_chown(st, created)) {
+        STATS_CALL(CALL_SETATTR);
+        int result = fchownat(dirfd, name, st->st_uid, st->st_gid, AT_SYMLINK_NOFOLLOW);
+        if (chown_failed(result)) {
+            return -1;
+        }
+        chowned = result == 0;
+    }
+    if (!S_ISLNK(st->st_mode) && needs_chmod(st, created, chowned)) {
+        STATS_CALL(CALL_SETATTR);
+        if (fchmodat(dirfd, name, st->st_mode & 07777, 0) != 0) {
+            return -1;
+        }
+    }
+    STATS_CALL(CALL_SETATTR);
+    return utimensat(dirfd, name, times, AT_SYMLINK_NOFOLLOW);
+}
+
+void tree_temp_name( char *name, size_t size )
+{
+    snprintf(name, size, ".copyit-tmp.%d.%u", (int)getpid(), atomic_fetch_add(&temp_counter, 1));
+}
+
+int tree_create_temp( struct tree_dir *dir, mode_t mode, char **temp_name )
+{
+    char name[64];
+    int fd;
+
+    *temp_name = NULL;
+    if (!no_tmpfile) {
+        STATS_CALL(CALL_OPEN);
+        fd = openat(dir->dest_fd, ".", O_WRONLY | O_TMPFILE | O_CLOEXEC, mode);
+        if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)) {
+            return fd;
+        }
+        no_tmpfile = 1;
+    }
+
+    do {
+        tree_temp_name(name, sizeof(name));
+        STATS_CALL(CALL_OPEN);
+        fd = openat(dir->dest_fd, name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+    } while (fd < 0 && errno == EEXIST);
+
+    if (fd >= 0 && !(*temp_name = strdup(name))) {
+        perror("copyit: Out of memory");
+        exit(1);
+    }
+    return fd;
+}
+
+int tree_commit( struct tree_dir *dir, int fd, const char *temp_name, const char *name )
+{
+    char proc_path[64], link_name[64];
+
+    STATS_CALL(CALL_LINK);
+    if (temp_name) {
+        return renameat(dir->dest_fd, temp_name, dir->dest_fd, name);
+    }
+
+    // An unnamed file can only be linked in, and link() will not replace an
+    // existing name, so an old file is replaced through a temporary name.
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+    int result = linkat(AT_FDCWD, proc_path, dir->dest_fd, name, AT_SYMLINK_FOLLOW);
+    if (result == 0 || errno != EEXIST) {
+        return result;
+    }
+
+    do {
+        tree_temp_name(link_name, sizeof(link_name));
+        STATS_CALL(CALL_LINK);
+        result = linkat(AT_FDCWD, proc_path, dir->dest_fd, link_name, AT_SYMLINK_FOLLOW);
+    } while (result != 0 && errno == EEXIST);
+    if (result != 0) {
+        return -1;
+    }
+
+    STATS_CALL(CALL_LINK);
+    if (renameat(dir->dest_fd, link_name, dir->dest_fd, name) != 0) {
+        int error = errno;
+        unlinkat(dir->dest_fd, link_name, 0);
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+void tree_discard( struct tree_dir *dir, const char *temp_name )
+{
+    if (temp_name) {
+        unlinkat(dir->dest_fd, temp_name, 0);
+    }
+}
+
+static size_t link_hash( dev_t dev, ino_t ino )
+{
+    unsigned long long h = (unsigned long long)ino * 0x9E3779B97F4A7C15ULL ^ dev;
+    return (h ^ (h >> 29)) & (link_buckets - 1);
+}
+
+static struct link_entry *link_find( dev_t dev, ino_t ino )
+{
+    if (link_count == 0) {
+        return NULL;
+    }
+    for (struct link_entry *e = link_table[link_hash(dev, ino)]; e; e = e->next) {
+        if (e->dev == dev && e->ino == ino) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static struct link_entry *link_add( dev_t dev, ino_t ino )
+{
+    if (link_count >= link_buckets) {
+        size_t old_buckets = link_buckets;
+        struct link_entry **old_table = link_table;
+
+        link_buckets = link_buckets ? link_buckets * 2 : 1024;
+        link_table = calloc(link_buckets, sizeof(*link_table));
+        if (!link_table) {
+            perror("copyit: Out of memory");
+            exit(1);
+        }
+        for (size_t i = 0; i < old_buckets; i++) {
+            while (old_table[i]) {
+                struct link_entry *e = old_table[i];
+                old_table[i] = e->next;
+                size_t h = link_hash(e->dev, e->ino);
+                e->next = link_table[h];
+                link_table[h] = e;
+            }
+        }
+        free(old_table);
+    }
+
+    struct link_entry *e = malloc(sizeof(*e));
+    if (!e) {
+        perror("copyit: Out of memory");
+        exit(1);
+    }
+    size_t h = link_hash(dev, ino);
+    e->dev = dev;
+    e->ino = ino;
+    e->path = NULL;
+    e->copying = 0;
+    e->next = link_table[h];
+    link_table[h] = e;
+    link_count++;
+    return e;
+}
+
+const char *tree_link_claim( dev_t dev, ino_t ino )
+{
+    pthread_mutex_lock(&links_lock);
+    struct link_entry *e = link_find(dev, ino);
+    if (!e) {
+        e = link_add(dev, ino);
+    }
+    // Entries never move, however the table grows, so e stays valid while we wait.
+    while (e->copying) {
+        pthread_cond_wait(&link_copied, &links_lock);
+    }
+    const char *path = e->path;
+    e->copying = !path;
+    pthread_mutex_unlock(&links_lock);
+    return path;
+}
+
+void tree_link_done( dev_t dev, ino_t ino, char *path )
+{
+    pthread_mutex_lock(&links_lock);
+    struct link_entry *e = link_find(dev, ino);
+    e->path = path;
+    e->copying = 0;
+    pthread_cond_broadcast(&link_copied);
+    pthread_mutex_unlock(&links_lock);
+}
@@ -0,0 +1,110 @@
+#ifndef COPYTREE_H
+#define COPYTREE_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdatomic.h>
+
+/*
+A directory being copied, held open on both sides so that its entries are
+reached with *at() calls relative to the two descriptors instead of
+re-resolving a full path for every file.  Each entry still being copied holds
+a reference; whoever drops the last one gives the target directory the
+source's mode, owner and timestamps (only now, since adding entries would
+change its mtime again) and closes both descriptors.
+*/
+struct tree_dir {
+    struct tree_dir *parent;
+    int src_fd;
+    int dest_fd;
+    char *src_name;     // names inside parent, kept for building paths on demand
+    char *dest_name;
+    struct stat st;
+    atomic_int refs;
+};
+
+/** The current directory: parent of the paths given on the command line. */
+extern struct tree_dir tree_cwd;
+
+/** Record the umask and raise the open file limit.  Call once before copying. */
+void tree_init( void );
+
+/** statx() name inside the source directory dir; follow says whether a final symlink is followed. */
+int tree_stat( struct tree_dir *dir, const char *name, int follow, struct stat *st );
+
+/**
+Create the target directory dest_name inside parent if it is missing, and
+open it and the source directory src_name.  st is the source's stat, restored
+on the target by the last tree_release().  Returns the directory holding one
+reference, or NULL with errno set.
+*/
+struct tree_dir *tree_open_dir( struct tree_dir *parent, const char *src_name, const char *dest_name, const struct stat *st );
+
+void tree_hold( struct tree_dir *dir );
+
+/** Drop a reference to dir (see above).  Returns -1 if its metadata could not be restored. */
+int tree_release( struct tree_dir *dir );
+
+/** Full source (or, if dest, target) path of name inside dir, for messages and hard links.  Free it. */
+char *tree_path( struct tree_dir *dir, const char *name, int dest );
+
+/** Reads the entries of a directory descriptor in large getdents64() batches. */
+struct tree_reader {
+    int fd;
+    int pos;
+    int len;
+    int error;          // errno if reading stopped early, else 0
+    char *buf;
+};
+
+void tree_reader_open( struct tree_reader *r, int fd );
+
+/** Return the next entry's name, skipping "." and "..", or NULL at the end. */
+const char *tree_read( struct tree_reader *r );
+
+void tree_reader_close( struct tree_reader *r );
+
+/**
+Give an open target file the mode, owner and timestamps of the source's st.
+created says the file was just created with st's mode, so chmod can be
+skipped unless the umask or a chown got in the way.  Ownership is only
+changed where permitted.
+*/
+int tree_set_attrs( int fd, const struct stat *st, int created );
+
+/** The same for name inside dirfd, which may be a symlink (whose mode is left alone). */
+int tree_set_attrs_at( int dirfd, const char *name, const struct stat *st, int created );
+
+/**
+Create a file in the target directory dir to copy into before it is put in
+place.  It is unnamed (O_TMPFILE) where the filesystem allows, or else gets a
+hidden temporary name, returned in *temp_name for the caller to free.
+Returns the descriptor, or -1 with errno set.
+*/
+int tree_create_temp( struct tree_dir *dir, mode_t mode, char **temp_name );
+
+/** A hidden name for a file being copied into, unique to this process. */
+void tree_temp_name( char *name, size_t size );
+
+/** Atomically put a file from tree_create_temp() in place as name, replacing any old file. */
+int tree_commit( struct tree_dir *dir, int fd, const char *temp_name, const char *name );
+
+/** Throw away a file from tree_create_temp() that will not be committed.  The caller still closes fd. */
+void tree_discard( struct tree_dir *dir, const char *temp_name );
+
+/*
+Hard links: the target path each multiply-linked source inode was first
+copied to.  Returns that path, or NULL after reserving dev/ino for the
+caller, who then makes the first copy and calls tree_link_done().  While
+another thread holds the reservation this waits, but only callers asking
+for that same inode do, so no link is made to a target that does not exist yet.
+*/
+const char *tree_link_claim( dev_t dev, ino_t ino );
+
+/**
+End a reservation: record path (which the map takes over) as the first copy
+of dev/ino, or with NULL let the next link of it try to make one.
+*/
+void tree_link_done( dev_t dev, ino_t ino, char *path );
+
+#endif
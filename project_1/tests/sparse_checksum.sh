@@ -0,0 +1,28 @@
+#!/bin/sh
+# A sparse source copied with --checksum must stay sparse and match byte for byte.
+set -e
+
+copyit=${1:-./copyit_extracredit}
+work=$(mktemp -d "${TMPDIR:-/tmp}/copyit-check.XXXXXX")
+trap 'rm -rf "$work"' EXIT
+
+mkdir "$work/src"
+truncate -s 64M "$work/src/disk"
+printf 'data in the middle' | dd of="$work/src/disk" bs=1 seek=33554432 conv=notrunc 2>/dev/null
+printf 'data at the start' | dd of="$work/src/disk" conv=notrunc 2>/dev/null
+
+"$copyit" --checksum crc32c "$work/src" "$work/dest" >/dev/null
+cmp "$work/src/disk" "$work/dest/disk"
+"$copyit" --verify "$work/dest" >/dev/null
+
+src_blocks=$(stat -c %b "$work/src/disk")
+dest_blocks=$(stat -c %b "$work/dest/disk")
+if [ "$src_blocks" -ge $((64 * 2048)) ]; then
+    echo "sparse_checksum: skipped, $work does not keep holes"
+    exit 0
+fi
+if [ "$dest_blocks" -gt $((src_blocks * 2 + 64)) ]; then
+    echo "sparse_checksum: FAIL, copy has $dest_blocks blocks for a source with $src_blocks"
+    exit 1
+fi
+echo "sparse_checksum: ok, $dest_blocks blocks for a source with $src_blocks"
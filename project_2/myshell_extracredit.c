@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,136 +7,273 @@
 #include <sys/wait.h>
 #include <signal.h>
 #include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+
+#include "shelljob.h"
+#include "shellpath.h"
+#include "shellparallel.h"
+#include "shelltok.h"
+#include "shellacct.h"
+#include "shelllaunch.h"
+#include "shellsuper.h"
 
 #define MAX_INPUT_SIZE 4096
-#define MAX_WORDS 100
 
 char input[MAX_INPUT_SIZE];
-char *words[MAX_WORDS];
+char **words;
+
+// The current command's words live here, and go when the next one is read.
+struct arena arena;
+char *no_words[1];
+
+// The script being run (myshell -f, or a stdin that is not a terminal), or NULL.
+FILE *script;
+char *script_line;
+size_t script_size;
+
+// Input read from stdin but not yet handed out as lines.
+char pending[MAX_INPUT_SIZE];
+int pending_len;
+
+// Report a finished job, unless it is a service's: the supervisor decides what happens to those.
+void finish_job(struct job *job) {
+    if (!super_finished(job)) {
+        job_report(job);
+        job_remove(job);
+    }
+}
+
+/*
+Report the jobs that have finished in the background.  They stay in the
+table, so wait can still collect their status.  Returns how many.
+*/
+int report_finished() {
+    struct job *job;
+    int n = 0;
+
+    while ((job = job_poll())) {
+        if (!super_finished(job)) {
+            job_report(job);
+            job->reported = 1;
+        }
+        n++;
+    }
+    return n;
+}
+
+// Keep services restarting and reporting readiness while the shell waits for a job.
+void supervise_while_waiting() {
+    super_poll();
+}
+
+/*
+Read one line into input.  While waiting for it, background jobs are reaped
+(and reported) the moment they exit, instead of lingering as zombies until
+the next wait.  Returns 1, 0 at the end of input or -1 on an error.
+*/
+int read_line() {
+    struct pollfd fds[3] = { { STDIN_FILENO, POLLIN, 0 }, { job_events(), POLLIN, 0 }, { super_events(), POLLIN, 0 } };
+
+    while (1) {
+        char *newline = memchr(pending, '\n', pending_len);
+        if (newline || pending_len == MAX_INPUT_SIZE - 1) {
+            int len = newline ? newline - pending + 1 : pending_len;
+            memcpy(input, pending, len);
+            input[len] = '\0';
+            pending_len -= len;
+            memmove(pending, pending + len, pending_len);
+            return 1;
+        }
+
+        if (poll(fds, 3, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        int events = 0;
+        if (fds[1].revents) {
+            events += report_finished();
+        }
+        if (fds[2].revents) {
+            events += super_poll();
+        }
+        if (events) {
+            printf("myshell> ");
+            fflush(stdout);
+        }
+        if (fds[0].revents) {
+            ssize_t n = read(STDIN_FILENO, pending + pending_len, MAX_INPUT_SIZE - 1 - pending_len);
+            if (n < 0 && errno != EINTR) {
+                return -1;
+            }
+            if (n == 0) {
+                if (pending_len == 0) {
+                    return 0;
+                }
+                // A last line without a newline.
+                memcpy(input, pending, pending_len);
+                input[pending_len] = '\0';
+                pending_len = 0;
+                return 1;
+            }
+            if (n > 0) {
+                pending_len += n;
+            }
+        }
+    }
+}
+
+// Split a line into words that last until the next line is split.
+void split_words(const char *line) {
+    const char *error;
+
+    arena_reset(&arena);
+    if (!(words = tokenize(&arena, line, &error))) {
+        printf("myshell: %s\n", error);
+        words = no_words;
+    }
+}
 
 void read_input() {
+    // Jobs that finished while the shell was waiting for another one.
+    report_finished();
     printf("myshell> ");
     fflush(stdout);
 
-    if (!fgets(input, MAX_INPUT_SIZE, stdin)) {
-        if (feof(stdin)) {
-            printf("myshell: End of input detected. Exiting.\n");
-            exit(0);
-        } else {
-            perror("myshell: Error reading input");
+    int got = read_line();
+    if (got == 0) {
+        printf("myshell: End of input detected. Exiting.\n");
+        exit(0);
+    } else if (got < 0) {
+        perror("myshell: Error reading input");
+        exit(EXIT_FAILURE);
+    }
+
+    split_words(input);
+}
+
+/*
+Read the next line of a script: no prompt and no flush, lines of any length
+(getline() reuses one buffer) and background jobs reaped between commands.
+*/
+void read_script() {
+    report_finished();
+    super_poll();
+    if (getline(&script_line, &script_size, script) < 0) {
+        if (ferror(script)) {
+            perror("myshell: Error reading script");
             exit(EXIT_FAILURE);
         }
+        exit(0);
+    }
+    split_words(script_line);
+}
+
+// Send sig to a process, to every process of a job given as "%n", or to a service given as "@n".
+void signal_target(const char *spec, int sig) {
+    if (spec[0] == '@') {
+        super_signal(spec, sig);
+        return;
+    }
+    if (spec[0] == '%') {
+        struct job *job = job_find(spec);
+        if (!job) {
+            printf("myshell: No such job: %s\n", spec);
+        } else if (kill(-job->pgid, sig) < 0) {
+            perror("myshell: Error sending signal to job");
+        } else {
+            printf("myshell: signal %d sent to job %d\n", sig, job->id);
+            // Don't wait for the children's reports to show the new state in jobs.
+            if (sig == SIGCONT || sig == SIGSTOP) {
+                job->stopped = sig == SIGSTOP;
+            }
+        }
+        return;
+    }
+
+    pid_t target_pid = atoi(spec);
+    if (kill(target_pid, sig) < 0) {
+        perror("myshell: Error sending signal to process");
+    } else {
+        printf("myshell: signal %d sent to process %d\n", sig, target_pid);
     }
+}
+
+// Run a job in the foreground, and report it (with what it used, if timed) when it ends.
+void run_foreground(char **command, int timed) {
+    struct job *job;
 
-    char *token = strtok(input, " \t\n");
-    int i = 0;
-    while (token && i < MAX_WORDS - 1) {
-        words[i++] = token;
-        token = strtok(NULL, " \t\n");
+    if (!(job = launch_job(words[0], command)) || job_launch(job, 1) < 0) {
+        return;
+    }
+    struct job *done = job_wait(job, 1);
+    if (done && done->running == 0) {
+        job_report(job);
+        if (timed) {
+            acct_print(job);
+        }
+        job_remove(job);
+    } else if (done) {
+        printf("myshell: job %d stopped\n", job->id);
     }
-    words[i] = NULL;
 }
 
 void execute_command() {
-    pid_t pid, wpid;
-    int status;
-    int in_fd, out_fd;
+    struct job *job;
 
     if (!words[0]) {
         return;
     } else if (strcmp(words[0], "start") == 0) {
-        char *program = NULL;
-        int j;
-        for (j = 1; j < MAX_WORDS && words[j]; j++) {
-            if (words[j]) {
-                program = words[j];
-                break;
-            }
-        }
-        if (!program) {
+        if (!words[1]) {
             printf("myshell: 'start' requires a program to execute.\n");
             return;
         }
-
-        if ((pid = fork()) == 0) {
-            for (int i = 1; words[i]; i++) {
-                if (strcmp(words[i], "<") == 0 && words[i + 1]) {
-                    printf("Attempting to open input file: %s\n", words[i + 1]);
-                    in_fd = open(words[i + 1], O_RDONLY);
-                    if (in_fd == -1) {
-                        perror("myshell: Error opening input file");
-                        exit(EXIT_FAILURE);
-                    }
-                    printf("Input file opened with fd: %d\n", in_fd);
-                    if (dup2(in_fd, STDIN_FILENO) == -1) {
-                        perror("myshell: Error redirecting input");
-                        exit(EXIT_FAILURE);
-                    }
-                    close(in_fd);
-                    words[i] = NULL;
-                    words[i+1] = NULL;
-                }
-
-                if (strcmp(words[i], ">") == 0 && words[i + 1]) {
-                    printf("Attempting to open output file: %s\n", words[i + 1]);
-                    out_fd = open(words[i + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                    if (out_fd == -1) {
-                        perror("myshell: Error opening output file");
-                        exit(EXIT_FAILURE);
-                    }
-                    printf("Output file opened with fd: %d\n", out_fd);
-                    if (dup2(out_fd, STDOUT_FILENO) == -1) {
-                        perror("myshell: Error redirecting output");
-                        exit(EXIT_FAILURE);
-                    }
-                    close(out_fd);
-                    words[i] = NULL;
-                    words[i+1] = NULL;
-                }
-            }
-
-            execvp(program, &words[j]);
-            perror("myshell: Error executing command");
-            exit(EXIT_FAILURE);
-        } else if (pid < 0) {
-            perror("myshell: Error starting process");
+        if (!(job = launch_job("start", &words[1])) || job_launch(job, 0) < 0) {
+            return;
+        }
+        if (job->nstages == 1) {
+            printf("myshell: process %d started\n", job->stages[0].pid);
         } else {
-            printf("myshell: process %d started\n", pid);
+            printf("myshell: job %d started: processes", job->id);
+            for (int i = 0; i < job->nstages; i++) {
+                printf(" %d", job->stages[i].pid);
+            }
+            printf("\n");
         }
     } else if (strcmp(words[0], "wait") == 0) {
-        wpid = wait(&status);
-        if (wpid < 0) {
-            perror("myshell: Error waiting for process");
-            return;
+        if (words[1]) {
+            if (!(job = job_find(words[1]))) {
+                printf("myshell: No such job: %s\n", words[1]);
+                return;
+            }
+            job = job_wait(job, 0);
+        } else {
+            job = job_wait(NULL, 0);
         }
-        if (WIFEXITED(status)) {
-            printf("myshell: process %d exited normally with status %d\n", wpid, WEXITSTATUS(status));
-        } else if (WIFSIGNALED(status)) {
-            printf("myshell: process %d exited abnormally with signal %d: %s\n", wpid, WTERMSIG(status), strsignal(WTERMSIG(status)));
+        if (job) {
+            finish_job(job);
         }
     } else if (strcmp(words[0], "run") == 0) {
         if (!words[1]) {
             printf("myshell: 'run' requires a program to execute.\n");
             return;
         }
-
-        if ((pid = fork()) == 0) {
-            execvp(words[1], &words[1]);
-            perror("myshell: Error executing command");
-            exit(EXIT_FAILURE);
-        } else if (pid < 0) {
-            perror("myshell: Error starting process");
+        run_foreground(&words[1], 0);
+    } else if (strcmp(words[0], "time") == 0) {
+        // "time run prog" reads naturally too.
+        char **command = words[1] && strcmp(words[1], "run") == 0 ? &words[2] : &words[1];
+        if (!command[0]) {
+            printf("myshell: 'time' requires a program to execute.\n");
+            return;
+        }
+        run_foreground(command, 1);
+    } else if (strcmp(words[0], "stats") == 0) {
+        if (words[1] && strcmp(words[1], "-r") == 0) {
+            acct_reset();
         } else {
-            wpid = waitpid(pid, &status, 0);
-            if (wpid < 0) {
-                perror("myshell: Error waiting for process");
-                return;
-            }
-            if (WIFEXITED(status)) {
-                printf("myshell: process %d exited normally with status %d\n", wpid, WEXITSTATUS(status));
-            } else if (WIFSIGNALED(status)) {
-                printf("myshell: process %d exited abnormally with signal %d: %s\n", wpid, WTERMSIG(status), strsignal(WTERMSIG(status)));
-            }
+            acct_summary();
         }
     } else if (strcmp(words[0], "kill") == 0 || strcmp(words[0], "stop") == 0 || strcmp(words[0], "continue") == 0) {
         if (!words[1]) {
@@ -150,12 +288,35 @@ void execute_command() {
         } else {
             sig = SIGCONT;
         }
-
-        pid_t target_pid = atoi(words[1]);
-        if (kill(target_pid, sig) < 0) {
-            perror("myshell: Error sending signal to process");
+        signal_target(words[1], sig);
+    } else if (strcmp(words[0], "set") == 0) {
+        if (words[1] && strcmp(words[1], "pipesize") == 0 && words[2]) {
+            job_set_pipe_size(atoi(words[2]));
+            printf("myshell: pipesize set to %d\n", atoi(words[2]));
+        } else if (words[1] && strcmp(words[1], "cgroup") == 0 && words[2] &&
+                   (strcmp(words[2], "on") == 0 || strcmp(words[2], "off") == 0)) {
+            if (acct_use_cgroups(strcmp(words[2], "on") == 0) == 0) {
+                printf("myshell: cgroup set to %s\n", words[2]);
+            }
+        } else {
+            printf("myshell: usage: set pipesize <bytes> | set cgroup on|off\n");
+        }
+    } else if (strcmp(words[0], "parallel") == 0) {
+        parallel_run(&words[1]);
+    } else if (strcmp(words[0], "supervise") == 0) {
+        super_start(&words[1]);
+    } else if (strcmp(words[0], "services") == 0) {
+        // Catch up on services that have exited or become ready since the last prompt.
+        report_finished();
+        super_poll();
+        super_list();
+    } else if (strcmp(words[0], "jobs") == 0) {
+        job_list();
+    } else if (strcmp(words[0], "hash") == 0) {
+        if (words[1] && strcmp(words[1], "-r") == 0) {
+            path_clear();
         } else {
-            printf("myshell: signal %d sent to process %d\n", sig, target_pid);
+            path_list();
         }
     } else if (strcmp(words[0], "exit") == 0 || strcmp(words[0], "quit") == 0) {
         exit(0);
@@ -164,9 +325,27 @@ void execute_command() {
     }
 }
 
-int main() {
+int main(int argc, char *argv[]) {
+    job_wait_hook(super_events(), supervise_while_waiting);
+
+    if (argc == 3 && strcmp(argv[1], "-f") == 0) {
+        if (!(script = fopen(argv[2], "re"))) {
+            perror("myshell: Error opening script");
+            exit(EXIT_FAILURE);
+        }
+    } else if (argc > 1) {
+        printf("Use: myshell [-f script]\n");
+        exit(EXIT_FAILURE);
+    } else if (!isatty(STDIN_FILENO)) {
+        script = stdin;
+    }
+
     while (1) {
-        read_input();
+        if (script) {
+            read_script();
+        } else {
+            read_input();
+        }
         execute_command();
     }
     return 0;
@@ -0,0 +1,299 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include "shelljob.h"
+#include "shellacct.h"
+
+// What every run of one program has used, added up.
+struct acct_entry {
+    char *name;
+    int runs;
+    double real;
+    double user;
+    double sys;
+    long max_rss;           // KiB, the largest of any run
+    long voluntary;
+    long involuntary;
+    long minor_faults;
+    long major_faults;
+    struct acct_entry *next;
+};
+
+struct acct_entry *summary;
+
+// The group the shell runs in, and the one under it that holds the jobs' groups (NULL while cgroups are off).
+char *cgroup_home;
+char *cgroup_base;
+int cgroup_jobs;
+
+double seconds(struct timeval tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+// Find where the cgroup v2 hierarchy is mounted and which group the shell is in.
+int cgroup_self(char *path, size_t size) {
+    char line[4096], mount[PATH_MAX] = "", group[PATH_MAX] = "";
+    FILE *f;
+
+    if ((f = fopen("/proc/self/mountinfo", "r"))) {
+        while (fgets(line, sizeof(line), f)) {
+            char *sep = strstr(line, " - ");
+            if (sep && strncmp(sep + 3, "cgroup2 ", 8) == 0) {
+                sscanf(line, "%*s %*s %*s %*s %4095s", mount);
+                break;
+            }
+        }
+        fclose(f);
+    }
+    if ((f = fopen("/proc/self/cgroup", "r"))) {
+        while (fgets(line, sizeof(line), f)) {
+            if (strncmp(line, "0::", 3) == 0) {
+                sscanf(line + 3, "%4095s", group);
+            }
+        }
+        fclose(f);
+    }
+    if (!mount[0] || !group[0]) {
+        errno = ENOENT;
+        return -1;
+    }
+    snprintf(path, size, "%s%s", mount, strcmp(group, "/") == 0 ? "" : group);
+    return 0;
+}
+
+int write_file(const char *path, const char *text) {
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    int ok = fd >= 0 && write(fd, text, strlen(text)) == (ssize_t)strlen(text);
+    if (fd >= 0) {
+        close(fd);
+    }
+    return ok ? 0 : -1;
+}
+
+void cgroup_remove_base() {
+    if (cgroup_base) {
+        rmdir(cgroup_base);
+        free(cgroup_base);
+        free(cgroup_home);
+        cgroup_base = cgroup_home = NULL;
+    }
+}
+
+int acct_use_cgroups(int on) {
+    static int registered;
+    char self[PATH_MAX], base[PATH_MAX + 32], control[PATH_MAX + 64];
+
+    if (!on) {
+        cgroup_remove_base();
+        return 0;
+    }
+    if (cgroup_base) {
+        return 0;
+    }
+    if (cgroup_self(self, sizeof(self)) < 0) {
+        perror("myshell: Error finding the cgroup v2 hierarchy");
+        return -1;
+    }
+    snprintf(base, sizeof(base), "%s/myshell-%d", self, getpid());
+    if (mkdir(base, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "myshell: Error creating cgroup %s: %s\n", base, strerror(errno));
+        return -1;
+    }
+
+    // Whichever controllers the parent delegates; cpu.stat is there regardless.
+    snprintf(control, sizeof(control), "%s/cgroup.subtree_control", base);
+    write_file(control, "+cpu");
+    write_file(control, "+memory");
+    write_file(control, "+io");
+
+    cgroup_home = strdup(self);
+    cgroup_base = strdup(base);
+    if (!registered) {
+        atexit(cgroup_remove_base);
+        registered = 1;
+    }
+    return 0;
+}
+
+// Move the shell itself into a group; whatever it starts from then on starts there.
+int cgroup_enter(const char *group) {
+    char path[PATH_MAX + 80], text[32];
+
+    snprintf(path, sizeof(path), "%s/cgroup.procs", group);
+    snprintf(text, sizeof(text), "%d", getpid());
+    return write_file(path, text);
+}
+
+/*
+Rather than moving each child once it has started, which could let a short
+one finish first, the shell steps into the job's group while it launches the
+job and steps back out afterwards.
+*/
+void acct_job_start(struct job *job) {
+    char path[PATH_MAX + 64];
+
+    job->cpu_usec = job->memory_peak = job->io_bytes = -1;
+    if (!cgroup_base) {
+        return;
+    }
+    snprintf(path, sizeof(path), "%s/job-%d", cgroup_base, ++cgroup_jobs);
+    if (mkdir(path, 0755) < 0) {
+        fprintf(stderr, "myshell: Error creating cgroup %s: %s\n", path, strerror(errno));
+        return;
+    }
+    if (cgroup_enter(path) < 0) {
+        fprintf(stderr, "myshell: Error entering cgroup %s: %s\n", path, strerror(errno));
+        rmdir(path);
+        return;
+    }
+    job->cgroup = strdup(path);
+}
+
+void acct_job_started(struct job *job) {
+    if (job->cgroup && cgroup_enter(cgroup_home) < 0) {
+        fprintf(stderr, "myshell: Error leaving cgroup %s: %s\n", job->cgroup, strerror(errno));
+    }
+}
+
+// Read "key value" lines (cpu.stat) or "dev key=value ..." lines (io.stat) and add up the values of key.
+long long read_stat(const char *dir, const char *file, const char *key) {
+    char path[PATH_MAX + 80], word[256];
+    size_t keylen = strlen(key);
+    long long total = -1;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    if (!(f = fopen(path, "r"))) {
+        return -1;
+    }
+    while (fscanf(f, "%255s", word) == 1) {
+        if (strncmp(word, key, keylen) != 0) {
+            continue;
+        }
+        long long value;
+        if ((word[keylen] == '=' && sscanf(word + keylen + 1, "%lld", &value) == 1) ||
+            (word[keylen] == '\0' && fscanf(f, "%lld", &value) == 1)) {
+            total = (total < 0 ? 0 : total) + value;
+        }
+    }
+    fclose(f);
+    return total;
+}
+
+long long read_number(const char *dir, const char *file) {
+    char path[PATH_MAX + 80];
+    long long value = -1;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/%s", dir, file);
+    if ((f = fopen(path, "r"))) {
+        if (fscanf(f, "%lld", &value) != 1) {
+            value = -1;
+        }
+        fclose(f);
+    }
+    return value;
+}
+
+struct acct_entry *find_entry(const char *name) {
+    struct acct_entry *e;
+
+    for (e = summary; e; e = e->next) {
+        if (strcmp(e->name, name) == 0) {
+            return e;
+        }
+    }
+    if (!(e = calloc(1, sizeof(*e))) || !(e->name = strdup(name))) {
+        perror("myshell: Out of memory");
+        exit(EXIT_FAILURE);
+    }
+    e->next = summary;
+    summary = e;
+    return e;
+}
+
+void acct_job_end(struct job *job) {
+    if (job->cgroup) {
+        long long rbytes = read_stat(job->cgroup, "io.stat", "rbytes");
+        long long wbytes = read_stat(job->cgroup, "io.stat", "wbytes");
+
+        job->cpu_usec = read_stat(job->cgroup, "cpu.stat", "usage_usec");
+        job->memory_peak = read_number(job->cgroup, "memory.peak");
+        job->io_bytes = rbytes < 0 && wbytes < 0 ? -1 : (rbytes > 0 ? rbytes : 0) + (wbytes > 0 ? wbytes : 0);
+        rmdir(job->cgroup);
+    }
+
+    for (int i = 0; i < job->nstages; i++) {
+        struct stage *s = &job->stages[i];
+        struct acct_entry *e = find_entry(s->argv[0]);
+
+        e->runs++;
+        e->real += s->ended - job->started;
+        e->user += seconds(s->usage.ru_utime);
+        e->sys += seconds(s->usage.ru_stime);
+        if (s->usage.ru_maxrss > e->max_rss) {
+            e->max_rss = s->usage.ru_maxrss;
+        }
+        e->voluntary += s->usage.ru_nvcsw;
+        e->involuntary += s->usage.ru_nivcsw;
+        e->minor_faults += s->usage.ru_minflt;
+        e->major_faults += s->usage.ru_majflt;
+    }
+}
+
+void print_count(const char *label, long long value, const char *unit) {
+    if (value < 0) {
+        printf(" %s -", label);
+    } else {
+        printf(" %s %lld%s", label, value, unit);
+    }
+}
+
+void acct_print(struct job *job) {
+    for (int i = 0; i < job->nstages; i++) {
+        struct stage *s = &job->stages[i];
+        struct rusage *u = &s->usage;
+
+        printf("myshell: time: %s: real %.3fs user %.3fs sys %.3fs maxrss %ld KiB csw %ld/%ld faults %ld/%ld\n",
+               s->argv[0], s->ended - job->started, seconds(u->ru_utime), seconds(u->ru_stime),
+               u->ru_maxrss, u->ru_nvcsw, u->ru_nivcsw, u->ru_minflt, u->ru_majflt);
+    }
+    if (job->cgroup) {
+        printf("myshell: cgroup:");
+        if (job->cpu_usec < 0) {
+            printf(" cpu -");
+        } else {
+            printf(" cpu %.3fs", job->cpu_usec / 1e6);
+        }
+        print_count("memory.peak", job->memory_peak < 0 ? -1 : job->memory_peak / 1024, " KiB");
+        print_count("io", job->io_bytes, " bytes");
+        printf("\n");
+    }
+}
+
+void acct_summary() {
+    printf("%-16s %6s %10s %10s %10s %10s %9s %9s %10s %8s\n",
+           "program", "runs", "real s", "user s", "sys s", "maxrss KiB", "vol csw", "inv csw", "minflt", "majflt");
+    for (struct acct_entry *e = summary; e; e = e->next) {
+        printf("%-16s %6d %10.3f %10.3f %10.3f %10ld %9ld %9ld %10ld %8ld\n",
+               e->name, e->runs, e->real, e->user, e->sys, e->max_rss,
+               e->voluntary, e->involuntary, e->minor_faults, e->major_faults);
+    }
+}
+
+void acct_reset() {
+    while (summary) {
+        struct acct_entry *e = summary;
+        summary = e->next;
+        free(e->name);
+        free(e);
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef SHELLACCT_H
+#define SHELLACCT_H
+
+#include <sys/types.h>
+
+struct job;
+
+/**
+Put each new job in a cgroup v2 group of its own (on), so its CPU time,
+memory peak and I/O can be read when it ends, or stop doing so (off).
+Returns -1 after printing why if the shell can't make cgroups.
+*/
+int acct_use_cgroups(int on);
+
+/** Make the cgroup for a job about to start, if cgroups are on, so that its processes start in it. */
+void acct_job_start(struct job *job);
+
+/** Call once the job's processes have all been started (or failed to). */
+void acct_job_started(struct job *job);
+
+/** Read and remove a finished job's cgroup, and add its stages to the summary. */
+void acct_job_end(struct job *job);
+
+/** Print a finished job's resource use (time). */
+void acct_print(struct job *job);
+
+/** Print the resource use of every program run so far, by name (stats). */
+void acct_summary();
+
+/** Forget the summary (stats -r). */
+void acct_reset();
+
+#endif
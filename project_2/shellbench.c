@@ -0,0 +1,227 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "shellpath.h"
+
+/*
+Measure how fast each way of launching a program is, with the launching
+process made artificially large the way a long-running shell grows.  fork()
+has to copy the page tables of all that memory; posix_spawn() does not.
+Then time myshell itself running a long script.
+*/
+
+#define MAX_LIST 16
+#define MB (1024 * 1024)
+
+const char *program = "true";
+int count = 2000;
+const char *shell_path = "./myshell_extracredit";
+
+double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// The old myshell path: fork(), then execvp() searching PATH in the child.
+pid_t launch_fork(char **argv) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        execvp(argv[0], argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+pid_t launch_spawnp(char **argv) {
+    pid_t pid;
+    return posix_spawnp(&pid, argv[0], NULL, NULL, argv, environ) == 0 ? pid : -1;
+}
+
+// The new myshell path: posix_spawn() of a path resolved once through the cache.
+pid_t launch_spawn(char **argv) {
+    pid_t pid;
+    const char *path = path_lookup(argv[0]);
+    return path && posix_spawn(&pid, path, NULL, NULL, argv, environ) == 0 ? pid : -1;
+}
+
+struct method {
+    const char *name;
+    pid_t (*launch)(char **argv);
+} methods[] = {
+    { "fork", launch_fork },
+    { "spawnp", launch_spawnp },
+    { "spawn", launch_spawn },
+};
+
+#define NUM_METHODS (sizeof(methods) / sizeof(methods[0]))
+
+int split_list(char *list, char **items) {
+    int n = 0;
+    for (char *item = strtok(list, ","); item && n < MAX_LIST; item = strtok(NULL, ",")) {
+        items[n++] = item;
+    }
+    return n;
+}
+
+// Returns launches per second, or -1 if one failed.
+double run_method(struct method *m) {
+    char *argv[] = { (char *)program, NULL };
+    int status;
+
+    double start = now();
+    for (int i = 0; i < count; i++) {
+        pid_t pid = m->launch(argv);
+        if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+            return -1;
+        }
+    }
+    return count / (now() - start);
+}
+
+// Run a script of lines copies of line through myshell -f.  Returns commands per second.
+double run_script(int lines, const char *line) {
+    char script[] = "/tmp/shellbench.XXXXXX";
+    int fd = mkstemp(script);
+    FILE *f = fd >= 0 ? fdopen(fd, "w") : NULL;
+    int status;
+
+    if (!f) {
+        fprintf(stderr, "shellbench: couldn't create %s: %s\n", script, strerror(errno));
+        exit(1);
+    }
+    for (int i = 0; i < lines; i++) {
+        fprintf(f, "%s\n", line);
+    }
+    fclose(f);
+
+    double start = now();
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        execl(shell_path, shell_path, "-f", script, (char *)NULL);
+        _exit(127);
+    }
+    if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "shellbench: couldn't run %s -f %s\n", shell_path, script);
+        exit(1);
+    }
+    double elapsed = now() - start;
+
+    unlink(script);
+    return lines / elapsed;
+}
+
+void show_help() {
+    printf("Use: shellbench [options]\n");
+    printf("Where options are:\n");
+    printf("-n <count>    Launches per measurement. (default=2000)\n");
+    printf("-m <sizes>    Comma-separated MB of memory the launcher holds. (default=0,256,1024)\n");
+    printf("-e <methods>  Comma-separated launch methods: fork,spawnp,spawn. (default=all)\n");
+    printf("-c <program>  Program to launch. (default=true)\n");
+    printf("-S <lines>    Lines of the myshell script to time, 0 for none. (default=100000)\n");
+    printf("-l <line>     The script's line. (default=run true 'a b' \"c\\\"d\")\n");
+    printf("-b <path>     myshell binary. (default=./myshell_extracredit)\n");
+    printf("-h            Show this help text.\n");
+}
+
+int main(int argc, char *argv[]) {
+    char default_sizes[] = "0,256,1024";
+    char default_methods[] = "fork,spawnp,spawn";
+    char *size_list = default_sizes, *method_list = default_methods;
+    const char *script_line = "run true 'a b' \"c\\\"d\"";
+    int script_lines = 100000;
+    char *held = NULL;
+    size_t held_mb = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:m:e:c:S:l:b:h")) != -1) {
+        switch (c) {
+            case 'n':
+                count = atoi(optarg) > 0 ? atoi(optarg) : 1;
+                break;
+            case 'm':
+                size_list = optarg;
+                break;
+            case 'e':
+                method_list = optarg;
+                break;
+            case 'c':
+                program = optarg;
+                break;
+            case 'S':
+                script_lines = atoi(optarg);
+                break;
+            case 'l':
+                script_line = optarg;
+                break;
+            case 'b':
+                shell_path = optarg;
+                break;
+            default:
+                show_help();
+                exit(1);
+        }
+    }
+
+    char *sizes[MAX_LIST], *wanted[MAX_LIST];
+    int nsizes = split_list(size_list, sizes);
+    int nwanted = split_list(method_list, wanted);
+
+    printf("shellbench: %d launches of %s per measurement\n", count, program);
+    printf("%8s %-8s %12s %12s\n", "held MB", "method", "launches/s", "us/launch");
+
+    for (int s = 0; s < nsizes; s++) {
+        size_t mb = atol(sizes[s]);
+
+        // Touch every page, so the page tables fork() copies really exist.
+        if (mb > held_mb) {
+            if (!(held = realloc(held, mb * MB))) {
+                fprintf(stderr, "shellbench: couldn't allocate %zu MB\n", mb);
+                exit(1);
+            }
+            memset(held, 1, mb * MB);
+            held_mb = mb;
+        }
+
+        for (int w = 0; w < nwanted; w++) {
+            struct method *m = NULL;
+            for (int i = 0; i < NUM_METHODS; i++) {
+                if (strcmp(wanted[w], methods[i].name) == 0) {
+                    m = &methods[i];
+                }
+            }
+            if (!m) {
+                fprintf(stderr, "shellbench: unknown method %s\n", wanted[w]);
+                exit(1);
+            }
+
+            double rate = run_method(m);
+            if (rate < 0) {
+                fprintf(stderr, "shellbench: couldn't launch %s with %s\n", program, m->name);
+                exit(1);
+            }
+            printf("%8zu %-8s %12.0f %12.1f\n", held_mb, m->name, rate, 1e6 / rate);
+            fflush(stdout);
+        }
+    }
+
+    free(held);
+
+    if (script_lines > 0) {
+        double rate = run_script(script_lines, script_line);
+        printf("shellbench: myshell -f ran %d lines of '%s' at %.0f commands/s\n", script_lines, script_line, rate);
+    }
+    return 0;
+}
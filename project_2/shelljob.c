@@ -0,0 +1,531 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/signalfd.h>
+#include <sys/wait.h>
+
+#include "shelljob.h"
+#include "shellpath.h"
+#include "shellacct.h"
+#include "shelllaunch.h"
+#include "shelltok.h"
+
+// The job table, oldest first.
+struct job *jobs;
+int next_job_id = 1;
+int pipe_size;
+
+// Whether the shell owns a terminal to hand to foreground jobs.
+int terminal = -1;
+
+// The signalfd SIGCHLD is read from, once job_events() has made it.
+int events_fd = -1;
+
+// What else job_wait() watches while it waits, from job_wait_hook().
+int wait_fd = -1;
+void (*wait_hook)();
+
+double job_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void job_set_pipe_size(int bytes) {
+    pipe_size = bytes;
+}
+
+char *copy_word(const char *word) {
+    char *copy = strdup(word);
+    if (!copy) {
+        perror("myshell: Out of memory");
+        exit(EXIT_FAILURE);
+    }
+    return copy;
+}
+
+void job_free(struct job *job) {
+    for (int i = 0; i < job->nstages; i++) {
+        struct stage *s = &job->stages[i];
+        for (int j = 0; s->argv && s->argv[j]; j++) {
+            free(s->argv[j]);
+        }
+        free(s->argv);
+        free(s->in_file);
+        free(s->out_file);
+    }
+    if (job->cgroup) {
+        rmdir(job->cgroup);
+        free(job->cgroup);
+    }
+    free(job->options);
+    free(job->command);
+    free(job);
+}
+
+// Start a new stage, with room for every remaining word as an argument.
+struct stage *add_stage(struct job *job, int nwords) {
+    if (job->nstages == JOB_MAX_STAGES) {
+        printf("myshell: Too many stages in pipeline (at most %d).\n", JOB_MAX_STAGES);
+        return NULL;
+    }
+    struct stage *s = &job->stages[job->nstages++];
+    s->argv = calloc(nwords + 1, sizeof(char *));
+    if (!s->argv) {
+        perror("myshell: Out of memory");
+        exit(EXIT_FAILURE);
+    }
+    return s;
+}
+
+struct job *job_parse(char **words) {
+    int nwords = 0;
+    while (words[nwords]) {
+        nwords++;
+    }
+
+    struct job *job = calloc(1, sizeof(*job));
+    if (!job) {
+        perror("myshell: Out of memory");
+        exit(EXIT_FAILURE);
+    }
+
+    size_t len = 1;
+    for (int i = 0; i < nwords; i++) {
+        len += strlen(words[i]) + 1;
+    }
+    if (!(job->command = calloc(len, 1))) {
+        perror("myshell: Out of memory");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < nwords; i++) {
+        strcat(strcat(job->command, i ? " " : ""), words[i]);
+    }
+
+    struct stage *s = add_stage(job, nwords);
+    int argc = 0;
+    for (int i = 0; i <= nwords; i++) {
+        if (!words[i] || words[i] == tok_pipe) {
+            if (argc == 0) {
+                printf("myshell: Missing program in pipeline.\n");
+                goto fail;
+            }
+            if (!words[i]) {
+                break;
+            }
+            if (!(s = add_stage(job, nwords - i))) {
+                goto fail;
+            }
+            argc = 0;
+        } else if (words[i] == tok_in || words[i] == tok_out) {
+            if (!words[i + 1]) {
+                printf("myshell: '%s' requires a file name.\n", words[i]);
+                goto fail;
+            }
+            char **target = words[i] == tok_in ? &s->in_file : &s->out_file;
+            free(*target);
+            *target = copy_word(words[++i]);
+        } else {
+            s->argv[argc++] = copy_word(words[i]);
+        }
+    }
+    return job;
+
+fail:
+    job_free(job);
+    return NULL;
+}
+
+/*
+Start one stage with posix_spawn(), which glibc implements with
+clone(CLONE_VM|CLONE_VFORK): unlike fork() it copies no page tables, so a
+launch costs the same however large the shell has grown.  The pipes and the
+stage's own < and > become file actions, applied in that order.
+*/
+pid_t spawn_stage(struct job *job, struct stage *s, int in_fd, int out_fd) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t defaults, mask;
+    pid_t pid = -1;
+    int err;
+
+    posix_spawn_file_actions_init(&actions);
+    if (in_fd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, in_fd, STDIN_FILENO);
+    }
+    if (out_fd >= 0) {
+        posix_spawn_file_actions_adddup2(&actions, out_fd, STDOUT_FILENO);
+    }
+    if (s->in_file) {
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, s->in_file, O_RDONLY, 0);
+    }
+    if (s->out_file) {
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, s->out_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+
+    // The shell ignores SIGTTOU and blocks SIGCHLD, and both would outlive exec.
+    posix_spawnattr_init(&attr);
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGTTOU);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setpgroup(&attr, job->pgid);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        const char *path = path_lookup(s->argv[0]);
+        if (!path) {
+            err = errno;
+            break;
+        }
+        if (job->options) {
+            // posix_spawn() has no way to set affinity, limits or the rest.
+            pid = launch_spawn(path, s, job->pgid, in_fd, out_fd, job->options);
+            err = pid < 0 ? errno : 0;
+        } else {
+            err = posix_spawn(&pid, path, &actions, &attr, s->argv, environ);
+        }
+        // A cached program may have moved since; search PATH once more.
+        if (err == 0 || path == s->argv[0] || access(path, X_OK) == 0) {
+            break;
+        }
+        path_forget(s->argv[0]);
+    }
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    if (err) {
+        fprintf(stderr, "myshell: Error starting %s: %s\n", s->argv[0], strerror(err));
+        return -1;
+    }
+    return pid;
+}
+
+// Hand the terminal to a process group (the shell's own to take it back).
+void give_terminal(pid_t pgid) {
+    if (terminal < 0) {
+        terminal = isatty(STDIN_FILENO);
+        // A background shell would be stopped for changing the foreground group.
+        signal(SIGTTOU, SIG_IGN);
+    }
+    if (terminal) {
+        tcsetpgrp(STDIN_FILENO, pgid);
+    }
+}
+
+/*
+Every pipe is created close-on-exec, so each child keeps only the two ends
+its file actions dup2() onto its standard input and output, however long
+the pipeline.
+*/
+int job_launch(struct job *job, int foreground) {
+    int in_fd = -1;     // read end of the previous stage's pipe
+
+    // Keep what the shell has said so far ahead of what the job is about to say.
+    fflush(stdout);
+    job->started = job_clock();
+    acct_job_start(job);
+    for (int i = 0; i < job->nstages; i++) {
+        struct stage *s = &job->stages[i];
+        int fds[2] = { -1, -1 };
+
+        if (i + 1 < job->nstages) {
+            if (pipe2(fds, O_CLOEXEC) < 0) {
+                perror("myshell: Error creating pipe");
+                goto fail;
+            }
+            if (pipe_size > 0 && fcntl(fds[1], F_SETPIPE_SZ, pipe_size) < 0) {
+                perror("myshell: Error resizing pipe");
+            }
+        }
+
+        pid_t pid = spawn_stage(job, s, in_fd, fds[1]);
+        if (pid < 0) {
+            if (fds[0] >= 0) {
+                close(fds[0]);
+                close(fds[1]);
+            }
+            goto fail;
+        }
+
+        if (job->pgid == 0) {
+            job->pgid = pid;
+        }
+        s->pid = pid;
+        job->running++;
+
+        if (in_fd >= 0) {
+            close(in_fd);
+        }
+        if (fds[1] >= 0) {
+            close(fds[1]);
+        }
+        in_fd = fds[0];
+    }
+
+    acct_job_started(job);
+    job->id = next_job_id++;
+    struct job **tail = &jobs;
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    *tail = job;
+
+    if (foreground) {
+        give_terminal(job->pgid);
+    }
+    return 0;
+
+fail:
+    acct_job_started(job);
+    if (in_fd >= 0) {
+        close(in_fd);
+    }
+    // The stages already running could block forever on their pipes.
+    if (job->pgid) {
+        kill(-job->pgid, SIGKILL);
+        for (int i = 0; i < job->nstages; i++) {
+            if (job->stages[i].pid > 0) {
+                waitpid(job->stages[i].pid, NULL, 0);
+            }
+        }
+    }
+    job_free(job);
+    return -1;
+}
+
+void reap();
+
+struct job *find_process(pid_t pid, struct stage **stage) {
+    for (struct job *job = jobs; job; job = job->next) {
+        for (int i = 0; i < job->nstages; i++) {
+            if (job->stages[i].pid == pid) {
+                *stage = &job->stages[i];
+                return job;
+            }
+        }
+    }
+    return NULL;
+}
+
+// A finished job: target, or any one at all (leaving out those already reported unless reported_too).
+struct job *finished(struct job *target, int reported_too) {
+    if (target) {
+        return target->running == 0 ? target : NULL;
+    }
+    for (struct job *job = jobs; job; job = job->next) {
+        if (job->running == 0 && (reported_too || !job->reported)) {
+            return job;
+        }
+    }
+    return NULL;
+}
+
+// Record a status change of one of our processes.  Returns its job, or NULL if it is not ours.
+struct job *record(pid_t pid, int status, struct rusage *usage) {
+    struct stage *s;
+    struct job *job = find_process(pid, &s);
+
+    if (!job) {
+        return NULL;
+    }
+    if (WIFSTOPPED(status)) {
+        job->stopped = 1;
+    } else if (WIFCONTINUED(status)) {
+        job->stopped = 0;
+    } else if (!s->done) {
+        s->status = status;
+        s->done = 1;
+        s->ended = job_clock();
+        s->usage = *usage;
+        if (--job->running == 0) {
+            job->ended = s->ended;
+            acct_job_end(job);
+        }
+    }
+    return job;
+}
+
+void job_wait_hook(int fd, void (*hook)()) {
+    wait_fd = fd;
+    wait_hook = hook;
+}
+
+// Whether any job still has a process running.
+int any_running() {
+    for (struct job *job = jobs; job; job = job->next) {
+        if (job->running > 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+struct job *job_wait(struct job *target, int foreground) {
+    struct job *done;
+    struct rusage usage;
+    int status;
+
+    while (!(done = finished(target, 1))) {
+        if (wait_fd >= 0) {
+            // Sleep in poll() rather than wait4(), so the hook gets to run while a job is in the foreground.
+            if (foreground && target->stopped) {
+                done = target;
+                break;
+            }
+            if (!target && !any_running()) {
+                break;
+            }
+            struct pollfd fds[2] = { { job_events(), POLLIN, 0 }, { wait_fd, POLLIN, 0 } };
+            if (poll(fds, 2, -1) < 0 && errno != EINTR) {
+                perror("myshell: Error waiting for process");
+                break;
+            }
+            reap();
+            wait_hook();
+            continue;
+        }
+
+        pid_t pid = wait4(target ? -target->pgid : -1, &status, foreground ? WUNTRACED : 0, &usage);
+        if (pid < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // Waiting for any job when there is none left is not an error.
+            if (errno == ECHILD && !target) {
+                break;
+            }
+            perror("myshell: Error waiting for process");
+            break;
+        }
+
+        struct job *job = record(pid, status, &usage);
+        if (job && foreground && WIFSTOPPED(status)) {
+            done = job;
+            break;
+        }
+    }
+
+    if (foreground) {
+        give_terminal(getpgrp());
+    }
+    return done;
+}
+
+int job_events() {
+    if (events_fd < 0) {
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &mask, NULL);
+        events_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (events_fd < 0) {
+            perror("myshell: Error creating signalfd");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return events_fd;
+}
+
+// Collect every pending status change without blocking.
+void reap() {
+    struct signalfd_siginfo info;
+    struct rusage usage;
+    int status;
+    pid_t pid;
+
+    // One SIGCHLD may stand for several children, so reap until none is left either way.
+    while (read(job_events(), &info, sizeof(info)) == sizeof(info)) {
+    }
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0) {
+        record(pid, status, &usage);
+    }
+}
+
+struct job *job_reap(pid_t pid) {
+    struct rusage usage;
+    int status;
+
+    if (wait4(pid, &status, WNOHANG, &usage) > 0) {
+        return record(pid, status, &usage);
+    }
+    return NULL;
+}
+
+struct job *job_poll() {
+    reap();
+    return finished(NULL, 0);
+}
+
+void job_list() {
+    double t = job_clock();
+
+    reap();
+    for (struct job *job = jobs, *next; job; job = next) {
+        const char *state = job->running == 0 ? "Done" : job->stopped ? "Stopped" : "Running";
+        double runtime = (job->running == 0 ? job->ended : t) - job->started;
+
+        next = job->next;
+        printf("[%d] %-8s %9.1fs  pgid %-7d %s\n", job->id, state, runtime, job->pgid, job->command);
+        // Its status has been printed once already; this was the last time it is shown.
+        if (job->running == 0 && job->reported) {
+            job_remove(job);
+        }
+    }
+}
+
+void job_report(struct job *job) {
+    for (int i = 0; i < job->nstages; i++) {
+        struct stage *s = &job->stages[i];
+        char who[64];
+
+        if (job->nstages == 1) {
+            snprintf(who, sizeof(who), "process %d", s->pid);
+        } else {
+            snprintf(who, sizeof(who), "job %d stage %d: process %d", job->id, i + 1, s->pid);
+        }
+        if (WIFEXITED(s->status)) {
+            printf("myshell: %s exited normally with status %d\n", who, WEXITSTATUS(s->status));
+        } else if (WIFSIGNALED(s->status)) {
+            printf("myshell: %s exited abnormally with signal %d: %s\n", who, WTERMSIG(s->status), strsignal(WTERMSIG(s->status)));
+        }
+    }
+}
+
+void job_remove(struct job *job) {
+    for (struct job **p = &jobs; *p; p = &(*p)->next) {
+        if (*p == job) {
+            *p = job->next;
+            break;
+        }
+    }
+    job_free(job);
+    if (!jobs) {
+        next_job_id = 1;
+    }
+}
+
+struct job *job_find(const char *spec) {
+    struct stage *s;
+
+    if (spec[0] == '%') {
+        int id = atoi(spec + 1);
+        for (struct job *job = jobs; job; job = job->next) {
+            if (job->id == id) {
+                return job;
+            }
+        }
+        return NULL;
+    }
+    return find_process(atoi(spec), &s);
+}
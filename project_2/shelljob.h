@@ -0,0 +1,105 @@
+#ifndef SHELLJOB_H
+#define SHELLJOB_H
+
+#include <sys/types.h>
+#include <sys/resource.h>
+
+#define JOB_MAX_STAGES 32
+
+struct launch_options;
+
+/** One program of a pipeline. */
+struct stage {
+    char **argv;            // NULL-terminated, owned by the job
+    char *in_file;          // "< file", or NULL
+    char *out_file;         // "> file", or NULL
+    pid_t pid;
+    int status;             // from wait4(), once done
+    int done;
+    double ended;           // when it was reaped
+    struct rusage usage;    // what it used, from wait4()
+};
+
+/** The programs started by one command, connected by pipes and run in a process group of their own. */
+struct job {
+    int id;
+    pid_t pgid;
+    int nstages;
+    int running;            // stages not yet reaped
+    int stopped;
+    int reported;           // finished, and its status printed, but not yet waited for
+    char *command;          // the words it was parsed from
+    double started;         // CLOCK_MONOTONIC seconds
+    double ended;           // when its last stage was reaped
+    struct launch_options *options;     // applied to each stage before it execs, or NULL
+    char *cgroup;           // its own cgroup, if cgroups are on
+    long long cpu_usec;     // from the cgroup, or -1 if unknown
+    long long memory_peak;
+    long long io_bytes;
+    struct stage stages[JOB_MAX_STAGES];
+    struct job *next;
+};
+
+/** Seconds on CLOCK_MONOTONIC, the clock job start and end times are kept in. */
+double job_clock();
+
+/** Give the pipes of new pipelines a buffer of bytes (F_SETPIPE_SZ), or the kernel default if 0. */
+void job_set_pipe_size(int bytes);
+
+/**
+Parse words (NULL-terminated) as "prog args [< in] [> out] | prog args ... ".
+Only tokenize()'s operator words count as |, < and >.  Returns a new job that
+has not been started, or NULL after printing why not.
+*/
+struct job *job_parse(char **words);
+
+/**
+Start every stage of job and add it to the job table.  A foreground job gets
+the terminal while it runs.  Returns -1 (and frees job) if it could not start.
+*/
+int job_launch(struct job *job, int foreground);
+
+/**
+Reap children until job (or, if NULL, any job) has finished or, in the
+foreground, stopped.  Returns that job, or NULL if there is nothing to wait for.
+*/
+struct job *job_wait(struct job *job, int foreground);
+
+/**
+Have job_wait() also watch fd, and call hook each time it wakes up, for
+whatever has to keep going while the shell waits for a job.
+*/
+void job_wait_hook(int fd, void (*hook)());
+
+/**
+The descriptor (a signalfd for SIGCHLD, which it blocks) that becomes readable
+when a child changes state.  Poll it with the shell's input and call job_poll().
+*/
+int job_events();
+
+/**
+Reap every child that has changed state, without blocking.  Returns a job
+that has finished and not been reported, or NULL; call it until NULL to
+collect them all, setting reported on each.
+*/
+struct job *job_poll();
+
+/** Reap one process if it has exited, without blocking.  Returns its job, or NULL. */
+struct job *job_reap(pid_t pid);
+
+/**
+Print the job table: number, state, runtime and command (jobs).  Finished
+jobs already reported are shown this last time and then removed.
+*/
+void job_list();
+
+/** Print the status of each stage of a finished job. */
+void job_report(struct job *job);
+
+/** Take a finished job out of the table and free it. */
+void job_remove(struct job *job);
+
+/** Find a job by number ("%n") or by the pid of one of its processes; NULL if there is none. */
+struct job *job_find(const char *spec);
+
+#endif
@@ -0,0 +1,327 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+#include "shelljob.h"
+#include "shelllaunch.h"
+
+#define CHILD_STACK 65536
+
+const char *limit_names[3] = { "as", "nofile", "cpu" };
+const int limit_resources[3] = { RLIMIT_AS, RLIMIT_NOFILE, RLIMIT_CPU };
+
+void launch_usage() {
+    printf("Launch options, before the program:\n");
+    printf("-c <cpus>            Run on these CPUs only, e.g. 0-3,8.\n");
+    printf("-m <policy>[:nodes]  NUMA memory policy: bind, interleave, preferred or local.\n");
+    printf("-n <nice>            Nice value.\n");
+    printf("-s <class>[:prio]    Scheduling class: other, batch, idle, fifo or rr.\n");
+    printf("-l <limit>=<value>   Resource limit: as (bytes, K/M/G), nofile or cpu (seconds).\n");
+}
+
+// Parse "0-3,8" into a mask of at most limit bits.  Returns -1 if it isn't one.
+int parse_list(const char *list, int limit, void (*add)(int, void *), void *set) {
+    const char *p = list;
+
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10), last = first;
+        if (end == p) {
+            return -1;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p) {
+                return -1;
+            }
+        }
+        if (first < 0 || last < first || last >= limit) {
+            return -1;
+        }
+        for (long i = first; i <= last; i++) {
+            add(i, set);
+        }
+        if (*end == ',') {
+            end++;
+        } else if (*end) {
+            return -1;
+        }
+        p = end;
+    }
+    return 0;
+}
+
+void add_cpu(int cpu, void *set) {
+    CPU_SET(cpu, (cpu_set_t *)set);
+}
+
+void add_node(int node, void *set) {
+    *(unsigned long *)set |= 1UL << node;
+}
+
+int parse_memory_policy(const char *spec, struct launch_options *options) {
+    static const struct { const char *name; int mode; } policies[] = {
+        { "bind", MPOL_BIND }, { "interleave", MPOL_INTERLEAVE }, { "preferred", MPOL_PREFERRED }, { "local", MPOL_LOCAL },
+    };
+    const char *colon = strchr(spec, ':');
+    size_t len = colon ? (size_t)(colon - spec) : strlen(spec);
+
+    for (int i = 0; i < 4; i++) {
+        if (strlen(policies[i].name) == len && strncmp(spec, policies[i].name, len) == 0) {
+            options->memory_policy = policies[i].mode;
+            options->nodes = 0;
+            if (policies[i].mode == MPOL_LOCAL) {
+                return colon ? -1 : 0;
+            }
+            return colon && parse_list(colon + 1, 8 * sizeof(unsigned long), add_node, &options->nodes) == 0 ? 0 : -1;
+        }
+    }
+    return -1;
+}
+
+int parse_sched(const char *spec, struct launch_options *options) {
+    static const struct { const char *name; int policy; } classes[] = {
+        { "other", SCHED_OTHER }, { "batch", SCHED_BATCH }, { "idle", SCHED_IDLE }, { "fifo", SCHED_FIFO }, { "rr", SCHED_RR },
+    };
+    const char *colon = strchr(spec, ':');
+    size_t len = colon ? (size_t)(colon - spec) : strlen(spec);
+
+    for (int i = 0; i < 5; i++) {
+        if (strlen(classes[i].name) == len && strncmp(spec, classes[i].name, len) == 0) {
+            options->sched_policy = classes[i].policy;
+            options->sched_priority = colon ? atoi(colon + 1) : 0;
+            // The real-time classes need a priority; the others must have none.
+            int realtime = classes[i].policy == SCHED_FIFO || classes[i].policy == SCHED_RR;
+            if (!colon && realtime) {
+                options->sched_priority = 1;
+            }
+            return realtime || options->sched_priority == 0 ? 0 : -1;
+        }
+    }
+    return -1;
+}
+
+int parse_limit(const char *spec, struct launch_options *options) {
+    const char *eq = strchr(spec, '=');
+    char *end;
+
+    if (!eq) {
+        return -1;
+    }
+    for (int i = 0; i < 3; i++) {
+        if (strlen(limit_names[i]) != (size_t)(eq - spec) || strncmp(spec, limit_names[i], eq - spec) != 0) {
+            continue;
+        }
+        unsigned long long value = strtoull(eq + 1, &end, 10);
+        if (end == eq + 1) {
+            return -1;
+        }
+        switch (*end) {
+            case 'G': value <<= 10; // fall through
+            case 'M': value <<= 10; // fall through
+            case 'K': value <<= 10; end++; break;
+        }
+        if (*end) {
+            return -1;
+        }
+        options->use_limit[i] = 1;
+        options->limit[i] = value;
+        return 0;
+    }
+    return -1;
+}
+
+int launch_parse(char **words, struct launch_options *options) {
+    int i = 0;
+
+    memset(options, 0, sizeof(*options));
+    options->memory_policy = -1;
+    options->sched_policy = -1;
+
+    while (words[i] && words[i][0] == '-' && strlen(words[i]) == 2) {
+        char opt = words[i][1];
+        const char *arg = words[i + 1];
+        int bad;
+
+        if (!arg) {
+            printf("myshell: Option %s requires a value.\n", words[i]);
+            return -1;
+        }
+        switch (opt) {
+            case 'c':
+                CPU_ZERO(&options->cpus);
+                options->use_cpus = 1;
+                bad = parse_list(arg, CPU_SETSIZE, add_cpu, &options->cpus);
+                break;
+            case 'm':
+                bad = parse_memory_policy(arg, options);
+                break;
+            case 'n':
+                options->use_nice = 1;
+                options->nice = atoi(arg);
+                bad = 0;
+                break;
+            case 's':
+                bad = parse_sched(arg, options);
+                break;
+            case 'l':
+                bad = parse_limit(arg, options);
+                break;
+            default:
+                printf("myshell: Unknown launch option %s.\n", words[i]);
+                launch_usage();
+                return -1;
+        }
+        if (bad) {
+            printf("myshell: Bad value for %s: %s\n", words[i], arg);
+            launch_usage();
+            return -1;
+        }
+        i += 2;
+    }
+    return i;
+}
+
+struct job *launch_job(const char *builtin, char **command) {
+    struct launch_options options;
+    struct job *job;
+    int skip = launch_parse(command, &options);
+
+    if (skip < 0) {
+        return NULL;
+    }
+    if (!command[skip]) {
+        printf("myshell: '%s' requires a program to execute.\n", builtin);
+        return NULL;
+    }
+    if (!(job = job_parse(&command[skip]))) {
+        return NULL;
+    }
+    if (skip > 0) {
+        if (!(job->options = malloc(sizeof(options)))) {
+            perror("myshell: Out of memory");
+            exit(EXIT_FAILURE);
+        }
+        *job->options = options;
+    }
+    return job;
+}
+
+struct child_args {
+    const char *path;
+    struct stage *s;
+    pid_t pgid;
+    int in_fd;
+    int out_fd;
+    struct launch_options *options;
+    int error;              // errno of the step that failed, written by the child
+};
+
+int redirect_fd(const char *file, int flags, int target) {
+    int fd = open(file, flags | O_CLOEXEC, 0644);
+    if (fd < 0 || dup2(fd, target) < 0) {
+        return -1;
+    }
+    return close(fd);
+}
+
+int apply_options(struct launch_options *o) {
+    if (o->use_cpus && sched_setaffinity(0, sizeof(o->cpus), &o->cpus) < 0) {
+        return -1;
+    }
+    if (o->memory_policy >= 0 &&
+        syscall(SYS_set_mempolicy, o->memory_policy, o->nodes ? &o->nodes : NULL, o->nodes ? 8 * sizeof(o->nodes) + 1 : 0) < 0) {
+        return -1;
+    }
+    if (o->sched_policy >= 0) {
+        struct sched_param param = { .sched_priority = o->sched_priority };
+        if (sched_setscheduler(0, o->sched_policy, &param) < 0) {
+            return -1;
+        }
+    }
+    if (o->use_nice && setpriority(PRIO_PROCESS, 0, o->nice) < 0) {
+        return -1;
+    }
+    // Only the soft limit changes, so the program can raise it again if it needs to.
+    for (int i = 0; i < 3; i++) {
+        struct rlimit rl;
+        if (!o->use_limit[i]) {
+            continue;
+        }
+        if (getrlimit(limit_resources[i], &rl) < 0) {
+            return -1;
+        }
+        rl.rlim_cur = o->limit[i];
+        if (rl.rlim_max != RLIM_INFINITY && rl.rlim_cur > rl.rlim_max) {
+            rl.rlim_cur = rl.rlim_max;
+        }
+        if (setrlimit(limit_resources[i], &rl) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+The child shares the shell's memory (CLONE_VM) while the shell waits for it
+to exec or exit (CLONE_VFORK), so it must not allocate; it only makes system
+calls, and leaves its errno in args->error if one fails.
+*/
+int child_main(void *arg) {
+    struct child_args *a = arg;
+    sigset_t none;
+
+    signal(SIGTTOU, SIG_DFL);
+    if (setpgid(0, a->pgid) < 0 ||
+        (a->in_fd >= 0 && dup2(a->in_fd, STDIN_FILENO) < 0) ||
+        (a->out_fd >= 0 && dup2(a->out_fd, STDOUT_FILENO) < 0) ||
+        (a->s->in_file && redirect_fd(a->s->in_file, O_RDONLY, STDIN_FILENO) < 0) ||
+        (a->s->out_file && redirect_fd(a->s->out_file, O_WRONLY | O_CREAT | O_TRUNC, STDOUT_FILENO) < 0) ||
+        apply_options(a->options) < 0) {
+        a->error = errno;
+        _exit(127);
+    }
+    sigemptyset(&none);
+    sigprocmask(SIG_SETMASK, &none, NULL);
+    execve(a->path, a->s->argv, environ);
+    a->error = errno;
+    _exit(127);
+}
+
+pid_t launch_spawn(const char *path, struct stage *s, pid_t pgid, int in_fd, int out_fd, struct launch_options *options) {
+    static char *stack;
+    struct child_args args = { path, s, pgid, in_fd, out_fd, options, 0 };
+    sigset_t all, old;
+
+    if (!stack && !(stack = malloc(CHILD_STACK))) {
+        return -1;
+    }
+
+    // No handler may run on the child's stack before it has reset its signals.
+    sigfillset(&all);
+    sigprocmask(SIG_BLOCK, &all, &old);
+    pid_t pid = clone(child_main, stack + CHILD_STACK, CLONE_VM | CLONE_VFORK | SIGCHLD, &args);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+
+    if (pid < 0) {
+        return -1;
+    }
+    if (args.error) {
+        waitpid(pid, NULL, 0);
+        errno = args.error;
+        return -1;
+    }
+    return pid;
+}
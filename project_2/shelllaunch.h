@@ -0,0 +1,48 @@
+#ifndef SHELLLAUNCH_H
+#define SHELLLAUNCH_H
+
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+
+struct stage;
+struct job;
+
+/** Where and how a job's processes run, set up in each child before it execs (needs _GNU_SOURCE). */
+struct launch_options {
+    int use_cpus;
+    cpu_set_t cpus;                 // sched_setaffinity()
+    int memory_policy;              // an MPOL_ mode for set_mempolicy(), or -1
+    unsigned long nodes;            // its node mask
+    int use_nice;
+    int nice;
+    int sched_policy;               // SCHED_OTHER, SCHED_BATCH, ..., or -1
+    int sched_priority;
+    int use_limit[3];               // RLIMIT_AS, RLIMIT_NOFILE, RLIMIT_CPU
+    rlim_t limit[3];
+};
+
+/**
+Parse the launch options at the front of words (see launch_usage()) into
+options.  Returns how many words they took, or -1 after printing what is wrong.
+*/
+int launch_parse(char **words, struct launch_options *options);
+
+/**
+Parse launch options and then a pipeline (for builtin, named in messages)
+into a job that has not been started.  Returns NULL after printing why not.
+*/
+struct job *launch_job(const char *builtin, char **command);
+
+/** Print the launch options start, run and time accept. */
+void launch_usage();
+
+/**
+Start path as stage s would be started by posix_spawn(), in process group
+pgid (0 for a new one) with in_fd and out_fd as its standard input and output
+if not -1, but apply options in the child before it execs.  Returns the pid,
+or -1 with errno set to why the child could not exec.
+*/
+pid_t launch_spawn(const char *path, struct stage *s, pid_t pgid, int in_fd, int out_fd, struct launch_options *options);
+
+#endif
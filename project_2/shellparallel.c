@@ -0,0 +1,286 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+
+#include "shelljob.h"
+#include "shellparallel.h"
+#include "shelltok.h"
+
+#define MAX_EVENTS 64
+
+struct task {
+    const char *arg;
+    struct job *job;        // while running
+    double latency;         // seconds from launch to the last stage's exit
+    int status;             // exit status, 128 + signal, or -1 if it never started
+    int unwatched;          // stages without a pidfd, polled with job_reap() instead
+};
+
+// How often stages without a pidfd are polled, in milliseconds.
+#define POLL_INTERVAL 10
+
+// Copy word with every {} in it replaced by arg.  Returns NULL if out of memory.
+char *fill_holes(const char *word, const char *arg) {
+    size_t arg_len = strlen(arg);
+    size_t len = strlen(word);
+    const char *hole;
+
+    for (hole = strstr(word, "{}"); hole; hole = strstr(hole + 2, "{}")) {
+        len += arg_len - 2;
+    }
+    char *filled = malloc(len + 1);
+    if (!filled) {
+        return NULL;
+    }
+    char *out = filled;
+    while ((hole = strstr(word, "{}")) != NULL) {
+        memcpy(out, word, hole - word);
+        out += hole - word;
+        memcpy(out, arg, arg_len);
+        out += arg_len;
+        word = hole + 2;
+    }
+    strcpy(out, word);
+    return filled;
+}
+
+void free_words(char **words) {
+    for (int i = 0; words[i]; i++) {
+        if (!tok_operator(words[i])) {
+            free(words[i]);
+        }
+    }
+    free(words);
+}
+
+/*
+Substitute arg for every {} in the command's words as one task's command
+line.  Returns NULL if out of memory.
+*/
+char **task_words(char **command, int ncommand, const char *arg) {
+    char **words = calloc(ncommand + 2, sizeof(char *));
+    int placed = 0;
+
+    if (!words) {
+        return NULL;
+    }
+    for (int i = 0; i < ncommand; i++) {
+        // Operators stay the tokenizer's own words, so job_parse() still sees them as such.
+        if (tok_operator(command[i])) {
+            words[i] = command[i];
+            continue;
+        }
+        const char *hole = strstr(command[i], "{}");
+        words[i] = hole ? fill_holes(command[i], arg) : strdup(command[i]);
+        if (!words[i]) {
+            free_words(words);
+            return NULL;
+        }
+        placed |= hole != NULL;
+    }
+    if (!placed && !(words[ncommand] = strdup(arg))) {
+        free_words(words);
+        return NULL;
+    }
+    return words;
+}
+
+/*
+Start a task and watch each of its processes through a pidfd, or count it in
+t->unwatched if it cannot have one.  Returns how many it started.
+*/
+int task_start(struct task *t, char **command, int ncommand, int epoll_fd) {
+    char **words = task_words(command, ncommand, t->arg);
+    struct job *job;
+
+    if (!words) {
+        perror("myshell: Error starting task");
+        t->status = -1;
+        return 0;
+    }
+    job = job_parse(words);
+    free_words(words);
+    if (!job || job_launch(job, 0) < 0) {
+        t->status = -1;
+        return 0;
+    }
+    for (int i = 0; i < job->nstages; i++) {
+        pid_t pid = job->stages[i].pid;
+        int fd = syscall(SYS_pidfd_open, pid, 0);
+        struct epoll_event ev = { .events = EPOLLIN };
+
+        // The pid goes in the low half and the pidfd in the high half.
+        ev.data.u64 = (uint64_t)fd << 32 | (uint32_t)pid;
+        if (fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("myshell: Error watching process, polling it instead");
+            if (fd >= 0) {
+                close(fd);
+            }
+            t->unwatched++;
+        }
+    }
+    t->job = job;
+    return 1;
+}
+
+// A pipeline's status is its last stage's, as in sh.
+int task_status(struct job *job) {
+    int status = job->stages[job->nstages - 1].status;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+// Report the task whose job has just finished, and remove the job.  Returns 1 if the task failed.
+int task_finish(struct task *tasks, int ntasks, struct job *job) {
+    int failed = 0;
+
+    for (int t = 0; t < ntasks; t++) {
+        if (tasks[t].job == job) {
+            tasks[t].latency = job->ended - job->started;
+            tasks[t].status = task_status(job);
+            tasks[t].job = NULL;
+            printf("myshell: task %d (%s) exited with status %d in %.3fs\n", t + 1, tasks[t].arg, tasks[t].status, tasks[t].latency);
+            failed = tasks[t].status != 0;
+            break;
+        }
+    }
+    job_remove(job);
+    return failed;
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+double percentile(double *sorted, int n, double p) {
+    int i = (int)(p * n + 0.999999) - 1;
+    return sorted[i < 0 ? 0 : i >= n ? n - 1 : i];
+}
+
+void parallel_run(char **words) {
+    long slots = sysconf(_SC_NPROCESSORS_ONLN);
+    int i = 0;
+
+    if (words[0] && strcmp(words[0], "-j") == 0 && words[1]) {
+        slots = atoi(words[1]);
+        i = 2;
+    }
+    char **command = &words[i];
+    int ncommand = 0;
+    while (command[ncommand] && strcmp(command[ncommand], ":::") != 0) {
+        ncommand++;
+    }
+    if (slots < 1 || ncommand == 0 || !command[ncommand] || !command[ncommand + 1]) {
+        printf("myshell: usage: parallel [-j N] <command> ::: <args...>\n");
+        return;
+    }
+
+    char **args = &command[ncommand + 1];
+    int ntasks = 0;
+    while (args[ntasks]) {
+        ntasks++;
+    }
+
+    struct task *tasks = calloc(ntasks, sizeof(*tasks));
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (!tasks || epoll_fd < 0) {
+        perror("myshell: Error starting parallel");
+        free(tasks);
+        return;
+    }
+
+    int next = 0, running = 0, done = 0, failed = 0;
+    double start = job_clock();
+
+    // Top the pool up to slots whenever a task finishes, rather than in batches.
+    while (done < ntasks) {
+        while (running < slots && next < ntasks) {
+            tasks[next].arg = args[next];
+            if (task_start(&tasks[next], command, ncommand, epoll_fd)) {
+                running++;
+            } else {
+                done++;
+                failed++;
+            }
+            next++;
+        }
+        if (running == 0) {
+            continue;
+        }
+
+        // Tasks with a process that has no pidfd have to be polled.
+        int polling = 0;
+        for (int t = 0; t < next; t++) {
+            polling |= tasks[t].job && tasks[t].unwatched;
+        }
+
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, polling ? POLL_INTERVAL : -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("myshell: Error waiting for tasks");
+            break;
+        }
+
+        for (int e = 0; e < n; e++) {
+            pid_t pid = (uint32_t)events[e].data.u64;
+            close(events[e].data.u64 >> 32);
+
+            struct job *job = job_reap(pid);
+            if (!job || job->running > 0) {
+                continue;
+            }
+            failed += task_finish(tasks, next, job);
+            running--;
+            done++;
+        }
+
+        for (int t = 0; polling && t < next; t++) {
+            struct job *job = tasks[t].job;
+            if (!job || !tasks[t].unwatched) {
+                continue;
+            }
+            for (int i = 0; i < job->nstages; i++) {
+                if (!job->stages[i].done) {
+                    job_reap(job->stages[i].pid);
+                }
+            }
+            if (job->running == 0) {
+                failed += task_finish(tasks, next, job);
+                running--;
+                done++;
+            }
+        }
+    }
+    double elapsed = job_clock() - start;
+
+    double *latencies = malloc(ntasks * sizeof(double));
+    int nlatencies = 0;
+    for (int t = 0; latencies && t < ntasks; t++) {
+        if (tasks[t].status >= 0) {
+            latencies[nlatencies++] = tasks[t].latency;
+        }
+    }
+    printf("myshell: parallel: %d tasks, %d failed, -j %ld, %.3fs, %.1f tasks/s\n",
+           ntasks, failed, slots, elapsed, elapsed > 0 ? ntasks / elapsed : 0);
+    if (nlatencies > 0) {
+        qsort(latencies, nlatencies, sizeof(double), compare_doubles);
+        printf("myshell: parallel: latency p50 %.3fs p90 %.3fs p99 %.3fs max %.3fs\n",
+               percentile(latencies, nlatencies, 0.50), percentile(latencies, nlatencies, 0.90),
+               percentile(latencies, nlatencies, 0.99), latencies[nlatencies - 1]);
+    }
+
+    free(latencies);
+    free(tasks);
+    close(epoll_fd);
+}
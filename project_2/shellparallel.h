@@ -0,0 +1,12 @@
+#ifndef SHELLPARALLEL_H
+#define SHELLPARALLEL_H
+
+/**
+Run "[-j N] command ::: arg ...": command once per arg, with the arg put in
+place of every {} in command (or appended if it has none), keeping N of them
+running until all are done.  Prints each task's status and latency, then the
+throughput and latency percentiles of the whole batch.
+*/
+void parallel_run(char **words);
+
+#endif
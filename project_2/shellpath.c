@@ -0,0 +1,130 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "shellpath.h"
+
+#define PATH_BUCKETS 256
+
+struct path_entry {
+    char *name;
+    char *path;
+    int hits;
+    struct path_entry *next;
+};
+
+struct path_entry *path_table[PATH_BUCKETS];
+
+// The PATH the cache was filled from; a different one empties it.
+char *cached_path;
+
+unsigned path_hash(const char *name) {
+    unsigned h = 5381;
+    while (*name) {
+        h = h * 33 + (unsigned char)*name++;
+    }
+    return h % PATH_BUCKETS;
+}
+
+void path_clear() {
+    for (int i = 0; i < PATH_BUCKETS; i++) {
+        while (path_table[i]) {
+            struct path_entry *e = path_table[i];
+            path_table[i] = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+        }
+    }
+}
+
+// Search PATH the way execvp() does: an empty entry means the current directory.
+char *path_search(const char *name, const char *path) {
+    char candidate[PATH_MAX];
+    int err = ENOENT;
+
+    while (1) {
+        const char *end = strchrnul(path, ':');
+        int len = end - path;
+        struct stat st;
+
+        snprintf(candidate, sizeof(candidate), "%.*s%s%s", len, path, len ? "/" : "", name);
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode)) {
+            if (access(candidate, X_OK) == 0) {
+                return strdup(candidate);
+            }
+            err = EACCES;
+        }
+        if (!*end) {
+            break;
+        }
+        path = end + 1;
+    }
+    errno = err;
+    return NULL;
+}
+
+const char *path_lookup(const char *name) {
+    if (strchr(name, '/')) {
+        return name;
+    }
+
+    const char *path = getenv("PATH");
+    if (!path) {
+        path = "/bin:/usr/bin";
+    }
+    if (!cached_path || strcmp(cached_path, path) != 0) {
+        path_clear();
+        free(cached_path);
+        cached_path = strdup(path);
+    }
+
+    unsigned h = path_hash(name);
+    for (struct path_entry *e = path_table[h]; e; e = e->next) {
+        if (strcmp(e->name, name) == 0) {
+            e->hits++;
+            return e->path;
+        }
+    }
+
+    char *found = path_search(name, path);
+    if (!found) {
+        return NULL;
+    }
+    struct path_entry *e = malloc(sizeof(*e));
+    if (!e || !(e->name = strdup(name))) {
+        perror("myshell: Out of memory");
+        exit(EXIT_FAILURE);
+    }
+    e->path = found;
+    e->hits = 1;
+    e->next = path_table[h];
+    path_table[h] = e;
+    return found;
+}
+
+void path_forget(const char *name) {
+    for (struct path_entry **p = &path_table[path_hash(name)]; *p; p = &(*p)->next) {
+        if (strcmp((*p)->name, name) == 0) {
+            struct path_entry *e = *p;
+            *p = e->next;
+            free(e->name);
+            free(e->path);
+            free(e);
+            return;
+        }
+    }
+}
+
+void path_list() {
+    for (int i = 0; i < PATH_BUCKETS; i++) {
+        for (struct path_entry *e = path_table[i]; e; e = e->next) {
+            printf("%6d  %s\t%s\n", e->hits, e->name, e->path);
+        }
+    }
+}
@@ -0,0 +1,20 @@
+#ifndef SHELLPATH_H
+#define SHELLPATH_H
+
+/**
+Resolve a program name to the executable execvp() would run, searching PATH
+only the first time a name is seen.  Names containing a '/' are returned as
+they are.  Returns NULL, with errno set, if PATH has no such program.
+*/
+const char *path_lookup(const char *name);
+
+/** Drop a cached name whose file has gone, so the next lookup searches again. */
+void path_forget(const char *name);
+
+/** Empty the cache (hash -r). */
+void path_clear();
+
+/** Print each cached name with its path and how often it was used (hash). */
+void path_list();
+
+#endif
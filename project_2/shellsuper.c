@@ -0,0 +1,394 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "shelljob.h"
+#include "shelllaunch.h"
+#include "shellsuper.h"
+
+#define DEFAULT_BACKOFF 0.1
+#define DEFAULT_BACKOFF_MAX 30.0
+#define STABLE_RUN 10.0             // a run this long resets the backoff
+
+enum { POLICY_ALWAYS, POLICY_ON_FAILURE };
+enum { SERVICE_RUNNING, SERVICE_WAITING, SERVICE_HELD, SERVICE_DONE };
+
+const char *service_states[] = { "running", "waiting", "held", "done" };
+
+struct service {
+    int id;
+    char **command;         // launch options and pipeline, as typed
+    int policy;
+    int max_restarts;       // 0 for no limit
+    double backoff_min;
+    double backoff_max;
+    double backoff;         // the delay before the next restart
+    int state;
+    int killed;             // by the user: never restart
+    struct job *job;        // while running
+    int restarts;
+    double due;             // when a waiting service restarts
+    double started;         // when the current run was launched
+    double launch_latency;  // how long job_launch() took, last run
+    double ready_latency;   // launch to its "ready" line, last run, or -1
+    double uptime;          // all finished runs together
+    int ready_fd;           // read end of the current run's readiness pipe, or -1
+    int last_status;
+    struct service *next;
+};
+
+struct service *services;
+int next_service_id = 1;
+int super_fd = -1;
+int timer_fd = -1;
+
+int super_events() {
+    if (super_fd < 0) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+
+        super_fd = epoll_create1(EPOLL_CLOEXEC);
+        timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (super_fd < 0 || timer_fd < 0 || epoll_ctl(super_fd, EPOLL_CTL_ADD, timer_fd, &ev) < 0) {
+            perror("myshell: Error creating supervisor events");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return super_fd;
+}
+
+// Arm the timer for the earliest restart that is due, or disarm it.
+void arm_timer() {
+    struct itimerspec when = { { 0, 0 }, { 0, 0 } };
+    double earliest = 0;
+
+    for (struct service *sv = services; sv; sv = sv->next) {
+        if (sv->state == SERVICE_WAITING && (earliest == 0 || sv->due < earliest)) {
+            earliest = sv->due;
+        }
+    }
+    if (earliest > 0) {
+        // TFD_TIMER_ABSTIME with a time already past fires at once; zero would disarm.
+        when.it_value.tv_sec = (time_t)earliest;
+        when.it_value.tv_nsec = (long)((earliest - (time_t)earliest) * 1e9) + 1;
+        if (when.it_value.tv_nsec >= 1000000000) {
+            when.it_value.tv_sec++;
+            when.it_value.tv_nsec -= 1000000000;
+        }
+    }
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &when, NULL);
+}
+
+void close_ready(struct service *sv) {
+    if (sv->ready_fd >= 0) {
+        epoll_ctl(super_fd, EPOLL_CTL_DEL, sv->ready_fd, NULL);
+        close(sv->ready_fd);
+        sv->ready_fd = -1;
+    }
+}
+
+/*
+A service says it is ready by writing a line to the descriptor named in
+$MYSHELL_READY_FD.  The pipe's write end is the only descriptor the shell
+lets a child inherit, and only while this service is being launched.
+*/
+int launch(struct service *sv) {
+    struct job *job = launch_job("supervise", sv->command);
+    int fds[2] = { -1, -1 };
+    char fd_text[16];
+
+    if (!job) {
+        return -1;
+    }
+    if (pipe2(fds, 0) == 0) {
+        fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+        fcntl(fds[0], F_SETFL, O_NONBLOCK);
+        snprintf(fd_text, sizeof(fd_text), "%d", fds[1]);
+        setenv("MYSHELL_READY_FD", fd_text, 1);
+    }
+
+    double start = job_clock();
+    int result = job_launch(job, 0);
+    sv->launch_latency = job_clock() - start;
+
+    unsetenv("MYSHELL_READY_FD");
+    if (fds[1] >= 0) {
+        close(fds[1]);
+    }
+    if (result < 0) {
+        if (fds[0] >= 0) {
+            close(fds[0]);
+        }
+        return -1;
+    }
+
+    sv->job = job;
+    sv->state = SERVICE_RUNNING;
+    sv->started = start;
+    sv->ready_latency = -1;
+    sv->ready_fd = fds[0];
+    if (sv->ready_fd >= 0) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = sv };
+        epoll_ctl(super_events(), EPOLL_CTL_ADD, sv->ready_fd, &ev);
+    }
+    printf("myshell: service %d started as job %d, process %d (launch %.3f ms)\n",
+           sv->id, job->id, job->stages[0].pid, sv->launch_latency * 1e3);
+    return 0;
+}
+
+void super_start(char **words) {
+    struct service *sv = calloc(1, sizeof(*sv));
+    int i = 0;
+
+    if (!sv) {
+        perror("myshell: Out of memory");
+        exit(EXIT_FAILURE);
+    }
+    sv->policy = POLICY_ALWAYS;
+    sv->backoff_min = DEFAULT_BACKOFF;
+    sv->backoff_max = DEFAULT_BACKOFF_MAX;
+    sv->ready_fd = -1;
+
+    for (; words[i] && words[i + 1]; i += 2) {
+        if (strcmp(words[i], "-p") == 0 && strcmp(words[i + 1], "always") == 0) {
+            sv->policy = POLICY_ALWAYS;
+        } else if (strcmp(words[i], "-p") == 0 && strcmp(words[i + 1], "on-failure") == 0) {
+            sv->policy = POLICY_ON_FAILURE;
+        } else if (strcmp(words[i], "-R") == 0) {
+            sv->max_restarts = atoi(words[i + 1]);
+        } else if (strcmp(words[i], "-b") == 0) {
+            sv->backoff_min = atoi(words[i + 1]) / 1e3;
+        } else if (strcmp(words[i], "-B") == 0) {
+            sv->backoff_max = atoi(words[i + 1]) / 1e3;
+        } else {
+            break;
+        }
+    }
+    if (!words[i] || sv->backoff_min <= 0 || sv->backoff_max < sv->backoff_min) {
+        printf("myshell: usage: supervise [-p always|on-failure] [-R max restarts] [-b backoff ms] [-B max backoff ms] [launch options] <command>\n");
+        free(sv);
+        return;
+    }
+    sv->backoff = sv->backoff_min;
+
+    int n = 0;
+    while (words[i + n]) {
+        n++;
+    }
+    if (!(sv->command = calloc(n + 1, sizeof(char *)))) {
+        perror("myshell: Out of memory");
+        exit(EXIT_FAILURE);
+    }
+    for (int j = 0; j < n; j++) {
+        if (!(sv->command[j] = strdup(words[i + j]))) {
+            perror("myshell: Out of memory");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    sv->id = next_service_id++;
+    if (launch(sv) < 0) {
+        for (int j = 0; j < n; j++) {
+            free(sv->command[j]);
+        }
+        free(sv->command);
+        free(sv);
+        next_service_id--;
+        return;
+    }
+    struct service **tail = &services;
+    while (*tail) {
+        tail = &(*tail)->next;
+    }
+    *tail = sv;
+}
+
+struct service *find_service(struct job *job) {
+    for (struct service *sv = services; sv; sv = sv->next) {
+        if (sv->job == job) {
+            return sv;
+        }
+    }
+    return NULL;
+}
+
+// A job's status is its last stage's, as in sh.
+int exit_status(struct job *job) {
+    int status = job->stages[job->nstages - 1].status;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+int note_ready(struct service *sv, double arrived);
+
+int super_finished(struct job *job) {
+    struct service *sv = find_service(job);
+
+    if (!sv) {
+        return 0;
+    }
+    // A ready line written just before it exited is still in the pipe; it came in by the time the job ended at the latest.
+    if (sv->ready_fd >= 0) {
+        note_ready(sv, job->ended);
+    }
+    double run = job->ended - sv->started;
+    sv->uptime += run;
+    sv->last_status = exit_status(job);
+    sv->job = NULL;
+    close_ready(sv);
+    job_remove(job);
+
+    printf("myshell: service %d exited with status %d after %.3fs", sv->id, sv->last_status, run);
+    if (sv->killed || (sv->policy == POLICY_ON_FAILURE && sv->last_status == 0)) {
+        sv->state = SERVICE_DONE;
+        printf("\n");
+        return 1;
+    }
+    if (sv->max_restarts > 0 && sv->restarts >= sv->max_restarts) {
+        sv->state = SERVICE_DONE;
+        printf("; giving up after %d restarts\n", sv->restarts);
+        return 1;
+    }
+
+    // Back off further each time it dies quickly; a long run starts over.
+    if (run >= STABLE_RUN) {
+        sv->backoff = sv->backoff_min;
+    }
+    sv->state = SERVICE_WAITING;
+    sv->due = job_clock() + sv->backoff;
+    printf("; restarting in %.3fs\n", sv->backoff);
+    sv->backoff = sv->backoff * 2 < sv->backoff_max ? sv->backoff * 2 : sv->backoff_max;
+    arm_timer();
+    return 1;
+}
+
+// Returns 1 if the service has just said it is ready, in a line that arrived by the time arrived.
+int note_ready(struct service *sv, double arrived) {
+    char buf[256];
+    ssize_t n = read(sv->ready_fd, buf, sizeof(buf));
+    int ready = 0;
+
+    if (n < 0 && errno == EAGAIN) {
+        return 0;
+    }
+    if (n > 0 && sv->ready_latency < 0) {
+        sv->ready_latency = arrived - sv->started;
+        printf("myshell: service %d ready after %.3fs\n", sv->id, sv->ready_latency);
+        ready = 1;
+    }
+    // One line is all it takes; after that (or at EOF) stop listening.
+    close_ready(sv);
+    return ready;
+}
+
+int super_poll() {
+    struct epoll_event events[16];
+    int reported = 0;
+
+    if (super_fd < 0) {
+        return 0;
+    }
+    int n = epoll_wait(super_fd, events, 16, 0);
+    double woke = job_clock();
+    for (int i = 0; i < n; i++) {
+        struct service *sv = events[i].data.ptr;
+        if (sv) {
+            reported += note_ready(sv, woke);
+        }
+    }
+
+    // Services that ended while the shell was waiting for something else.
+    for (struct service *sv = services; sv; sv = sv->next) {
+        if (sv->job && sv->job->running == 0) {
+            reported += super_finished(sv->job);
+        }
+    }
+
+    // Whatever woke the shell, start every service that is due.
+    uint64_t expirations;
+    if (read(timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+        perror("myshell: Error reading supervisor timer");
+    }
+    double now = job_clock();
+    for (struct service *sv = services; sv; sv = sv->next) {
+        if (sv->state == SERVICE_WAITING && sv->due <= now) {
+            sv->restarts++;
+            if (launch(sv) < 0) {
+                sv->state = SERVICE_DONE;
+                printf("myshell: service %d could not be restarted\n", sv->id);
+            }
+            reported++;
+        }
+    }
+    arm_timer();
+    return reported;
+}
+
+void super_signal(const char *spec, int sig) {
+    int id = atoi(spec + 1);
+    struct service *sv = services;
+
+    while (sv && sv->id != id) {
+        sv = sv->next;
+    }
+    if (!sv) {
+        printf("myshell: No such service: %s\n", spec);
+        return;
+    }
+
+    if (sig == SIGKILL) {
+        sv->killed = 1;
+        if (sv->state != SERVICE_RUNNING) {
+            sv->state = SERVICE_DONE;
+        }
+    } else if (sig == SIGSTOP && sv->state == SERVICE_WAITING) {
+        sv->state = SERVICE_HELD;
+    } else if (sig == SIGCONT && sv->state == SERVICE_HELD) {
+        sv->state = SERVICE_WAITING;
+    }
+    arm_timer();
+
+    if (sv->job) {
+        if (kill(-sv->job->pgid, sig) < 0) {
+            perror("myshell: Error sending signal to service");
+            return;
+        }
+        if (sig == SIGCONT || sig == SIGSTOP) {
+            sv->job->stopped = sig == SIGSTOP;
+        }
+    }
+    printf("myshell: signal %d sent to service %d\n", sig, sv->id);
+}
+
+void super_list() {
+    double now = job_clock();
+
+    printf("%-4s %-8s %8s %8s %11s %11s %10s %10s  %s\n",
+           "id", "state", "job", "restarts", "launch ms", "ready s", "up s", "total up s", "command");
+    for (struct service *sv = services; sv; sv = sv->next) {
+        const char *state = sv->job && sv->job->stopped ? "stopped" : service_states[sv->state];
+        double up = sv->job ? now - sv->started : 0;
+        char job_text[16] = "-", ready_text[24] = "-";
+
+        if (sv->job) {
+            snprintf(job_text, sizeof(job_text), "%%%d", sv->job->id);
+        }
+        if (sv->ready_latency >= 0) {
+            snprintf(ready_text, sizeof(ready_text), "%.3f", sv->ready_latency);
+        }
+        printf("@%-3d %-8s %8s %8d %11.3f %11s %10.1f %10.1f ",
+               sv->id, state, job_text, sv->restarts, sv->launch_latency * 1e3, ready_text, up, sv->uptime + up);
+        for (int i = 0; sv->command[i]; i++) {
+            printf(" %s", sv->command[i]);
+        }
+        printf("\n");
+    }
+}
@@ -0,0 +1,41 @@
+#ifndef SHELLSUPER_H
+#define SHELLSUPER_H
+
+struct job;
+
+/**
+Start a supervised service from "[-p always|on-failure] [-R max] [-b ms]
+[-B ms] [launch options] command": a job that is started again, after an
+exponentially growing delay, whenever it ends (or only when it fails).
+*/
+void super_start(char **words);
+
+/**
+The descriptor that becomes readable when a service is due to restart or
+has said it is ready.  Poll it with the shell's input and call super_poll().
+*/
+int super_events();
+
+/**
+Restart the services that are due, note the ones that are ready and finish
+the ones whose jobs have ended, without blocking.  Returns how many events
+it reported.
+*/
+int super_poll();
+
+/**
+Tell the supervisor a job has finished.  Returns 1 if it was a service's job,
+which the supervisor has then reported and removed, or 0 if it is not its own.
+*/
+int super_finished(struct job *job);
+
+/**
+Send sig to service "@n": kill also stops it being restarted, stop holds
+its restarts too, and continue lets them (or one that is due) go ahead.
+*/
+void super_signal(const char *spec, int sig);
+
+/** Print every service: state, restarts, launch and ready latency, uptime (services). */
+void super_list();
+
+#endif
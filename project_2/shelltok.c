@@ -0,0 +1,139 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "shelltok.h"
+
+#define ARENA_BLOCK 65536
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    size_t used;
+    char data[];
+};
+
+void *arena_alloc(struct arena *a, size_t size) {
+    struct arena_block *b = a->blocks;
+
+    size = (size + 15) & ~(size_t)15;
+    if (!b || b->size - b->used < size) {
+        size_t block = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+        if (!(b = malloc(sizeof(*b) + block))) {
+            perror("myshell: Out of memory");
+            exit(EXIT_FAILURE);
+        }
+        b->size = block;
+        b->used = 0;
+        b->next = a->blocks;
+        a->blocks = b;
+    }
+    void *p = b->data + b->used;
+    b->used += size;
+    return p;
+}
+
+void arena_reset(struct arena *a) {
+    struct arena_block *b = a->blocks;
+    size_t total = 0;
+
+    if (!b) {
+        return;
+    }
+    if (!b->next) {
+        b->used = 0;
+        return;
+    }
+    // The last command needed several blocks: replace them with one that holds it all.
+    while (b) {
+        struct arena_block *next = b->next;
+        total += b->size;
+        free(b);
+        b = next;
+    }
+    a->blocks = NULL;
+    arena_alloc(a, total);
+    a->blocks->used = 0;
+}
+
+char tok_pipe[] = "|";
+char tok_in[] = "<";
+char tok_out[] = ">";
+
+int tok_operator(const char *word) {
+    return word == tok_pipe || word == tok_in || word == tok_out;
+}
+
+int blank(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+char **tokenize(struct arena *a, const char *line, const char **error) {
+    size_t len = strlen(line);
+
+    // Words are separated by blanks, so there are at most (len + 1) / 2 of them,
+    // and no word's text is longer than its source.
+    char **words = arena_alloc(a, ((len + 1) / 2 + 1) * sizeof(char *));
+    char *out = arena_alloc(a, len + (len + 1) / 2 + 1);
+    const char *p = line;
+    int n = 0;
+
+    while (1) {
+        while (blank(*p)) {
+            p++;
+        }
+        if (!*p || *p == '#') {
+            break;
+        }
+
+        char *word = out;
+        int quoted = 0;
+        words[n++] = word;
+        while (*p && !blank(*p)) {
+            if (*p == '\\') {
+                quoted = 1;
+                p++;
+                if (*p == '\n') {
+                    p++;
+                } else if (*p) {
+                    *out++ = *p++;
+                }
+            } else if (*p == '\'') {
+                quoted = 1;
+                for (p++; *p && *p != '\''; ) {
+                    *out++ = *p++;
+                }
+                if (!*p) {
+                    *error = "Unterminated ' quote.";
+                    return NULL;
+                }
+                p++;
+            } else if (*p == '"') {
+                quoted = 1;
+                for (p++; *p && *p != '"'; ) {
+                    if (*p == '\\' && p[1] && strchr("\"\\$`", p[1])) {
+                        p++;
+                    }
+                    *out++ = *p++;
+                }
+                if (!*p) {
+                    *error = "Unterminated \" quote.";
+                    return NULL;
+                }
+                p++;
+            } else {
+                *out++ = *p++;
+            }
+        }
+        *out++ = '\0';
+        if (!quoted && strcmp(word, "|") == 0) {
+            words[n - 1] = tok_pipe;
+        } else if (!quoted && strcmp(word, "<") == 0) {
+            words[n - 1] = tok_in;
+        } else if (!quoted && strcmp(word, ">") == 0) {
+            words[n - 1] = tok_out;
+        }
+    }
+    words[n] = NULL;
+    return words;
+}
@@ -0,0 +1,38 @@
+#ifndef SHELLTOK_H
+#define SHELLTOK_H
+
+#include <stddef.h>
+
+/** Memory handed out in order and given back all at once, one command at a time. */
+struct arena {
+    struct arena_block *blocks;     // newest first
+};
+
+/** Allocate size bytes that stay valid until the next arena_reset(). */
+void *arena_alloc(struct arena *a, size_t size);
+
+/**
+Give back everything allocated so far.  The arena keeps one block big enough
+for all of it, so a stream of similar commands allocates nothing after the first.
+*/
+void arena_reset(struct arena *a);
+
+/**
+Split line into words, allocated in a: blanks separate words, '...' keeps
+everything literally, "..." keeps everything but \" \\ \$ \` escapes, a
+backslash outside quotes escapes the next character and an unquoted # starts
+a comment.  Keeps no state between calls.  Returns the NULL-terminated words,
+or NULL with *error set if a quote is not closed.
+*/
+char **tokenize(struct arena *a, const char *line, const char **error);
+
+/**
+The words tokenize() returns for an unquoted |, < or >, so job_parse() can
+tell them from a quoted '|' or \>, which come back as ordinary words.
+*/
+extern char tok_pipe[], tok_in[], tok_out[];
+
+/** Whether word is one of the operators above (compared by address, not text). */
+int tok_operator(const char *word);
+
+#endif
@@ -1,4 +1,5 @@
 #include "bitmap.h"
+#include "mandelkernel.h"
 #include <getopt.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -6,11 +7,60 @@
 #include <errno.h>
 #include <string.h>
 #include <pthread.h>
+#include <stdatomic.h>
 #include <time.h>
+#include <stdint.h>
+
+// How the image is divided between threads (-t).
+enum { SCHEDULE_BANDS, SCHEDULE_ROWS, SCHEDULE_TILES, SCHEDULE_STEAL, SCHEDULE_SUBDIVIDE };
+
+const char *schedule_names[] = { "bands", "rows", "tiles", "steal", "subdivide" };
+
+// Rectangles narrower or shorter than this are computed rather than split.
+#define SUBDIVIDE_MIN 6
+
+// Default size of the rectangles subdivide starts from (-T).  Bigger ones
+// skip more pixels, as long as the threads still find enough to split.
+#define SUBDIVIDE_SEED 128
+
+// A rectangle of pixels from (x0,y0) up to but not including (x1,y1).
+typedef struct {
+    int x0, y0, x1, y1;
+} rect_t;
+
+// One thread's tiles, as a range packed into one word: the owner takes from
+// the front (low half) and thieves from the back (high half).
+typedef struct {
+    _Alignas(64) atomic_ullong range;
+} tile_deque_t;
+
+// Work shared by all the threads of one image.
+typedef struct {
+    int mode;
+    int tile_size;
+    int tiles_x;
+    int ntiles;
+    int nthreads;
+    atomic_int next;            // next row or tile, for rows and tiles
+    tile_deque_t *deques;       // one per thread, for steal
+    struct timespec start;
+
+    // For subdivide: rectangles waiting for a thread, how many are not done yet,
+    // and the iteration count of every pixel, -1 until it is known.
+    pthread_mutex_t lock;
+    pthread_cond_t more;
+    rect_t *rects;
+    int nrects;
+    int rects_size;
+    int pending;
+    atomic_int *counts;
+} schedule_t;
 
 // Define a structure to pass data to threads
 typedef struct {
-    struct bitmap *bm;
+    uint32_t *counts;           // iteration count of every pixel, row by row
+    int width;
+    int height;
     double xmin;
     double xmax;
     double ymin;
@@ -18,12 +68,43 @@ typedef struct {
     int max;
     int start_line;
     int end_line;
+    int id;
+    schedule_t *schedule;
+    double busy;                // CPU time this thread spent, in seconds
+    double finished;            // wall time from the start of the image until it ran out of work
+    int units;                  // rows or tiles it computed
+    int stolen;                 // tiles it took from other threads
+    long evaluated;             // pixels it ran the kernel on, for subdivide
 } thread_data_t;
 
+// Ways to color the iteration counts (-p).
+enum { PALETTE_HSV, PALETTE_GRAY };
+
+const char *palette_names[] = { "hsv", "gray" };
+
+// Header of a file of raw iteration counts (-S and -R).
+typedef struct {
+    char magic[8];
+    int width;
+    int height;
+    int max;
+} counts_header_t;
+
+#define COUNTS_MAGIC "MANDCNT1"
+
 int iteration_to_color( int i, int max );
-int iterations_at_point( double x, double y, int max );
 void *compute_image_thread(void *thread_arg);
 
+// The row kernel that computes escape times (-k), and the scalar one, for
+// single points where filling a whole vector would be wasted.
+escape_row_t escape_row;
+escape_row_t escape_point;
+
+// Whether the kernel may skip iterating points inside the set (-I turns it off),
+// and how many pixels it did that for.
+int shortcuts = 1;
+atomic_long shortcut_pixels;
+
 void show_help()
 {
     printf("Use: mandel [options]\n");
@@ -36,6 +117,15 @@ void show_help()
     printf("-H <pixels> Height of the image in pixels. (default=500)\n");
     printf("-o <file>   Set output file. (default=mandel.bmp)\n");
     printf("-n <threads> Number of threads. (default=1)\n");
+    printf("-t <mode>   How threads share the image: bands, rows, tiles, steal or subdivide. (default=bands)\n");
+    printf("-T <pixels> Tile size for tiles and steal, or starting rectangle size for subdivide. (default=32, 128 for subdivide)\n");
+    printf("-v          Show how busy each thread was.\n");
+    printf("-k <kernel> Escape time and coloring kernel: scalar, sse2, avx2, avx512 or auto. (default=auto)\n");
+    printf("-I          Iterate every point, without the cardioid, bulb and periodicity shortcuts.\n");
+    printf("-p <palette> Colors to use: hsv or gray. (default=hsv)\n");
+    printf("-S <file>   Also save the raw iteration counts to file.\n");
+    printf("-R <file>   Color the iteration counts saved in file instead of computing them.\n");
+    printf("-C          Check every kernel this CPU supports against scalar on the views below, then exit.\n");
     printf("-h          Show this help text.\n");
     printf("\nSome examples are:\n");
     printf("mandel -x -0.5 -y -0.5 -s 0.2\n");
@@ -43,30 +133,393 @@ void show_help()
     printf("mandel -x 0.286932 -y 0.014287 -s .0005 -m 1000\n\n");
 }
 
-void compute_image( struct bitmap *bm, double xmin, double xmax, double ymin, double ymax, int max )
+void compute_image( uint32_t *counts, int width, int height, double xmin, double xmax, double ymin, double ymax, int max )
 {
 	int i,j;
 
-	int width = bitmap_width(bm);
-	int height = bitmap_height(bm);
+	double xs[width];
 
-	// For every pixel in the image...
+	// Determine the x coordinate of every column once.
+	for(i=0;i<width;i++) {
+		xs[i] = xmin + i*(xmax-xmin)/width;
+	}
+
+	// For every row in the image...
 
 	for(j=0;j<height;j++) {
 
-		for(i=0;i<width;i++) {
+		double y = ymin + j*(ymax-ymin)/height;
 
-			// Determine the point in x,y space for that pixel.
-			double x = xmin + i*(xmax-xmin)/width;
-			double y = ymin + j*(ymax-ymin)/height;
+		// Compute the iterations at every point of the row.
+		atomic_fetch_add(&shortcut_pixels,escape_row(xs,y,width,max,shortcuts,counts+(long)j*width));
+	}
+}
 
-			// Compute the iterations at that point.
-			int iters = iterations_at_point(x,y,max);
+/*
+Compute the pixels from (x0,y0) up to but not including (x1,y1).
+*/
 
-			// Set the pixel in the bitmap.
-			bitmap_set(bm,i,j,iters);
-		}
-	}
+void compute_region( thread_data_t *data, int x0, int y0, int x1, int y1 )
+{
+    int width = data->width;
+    int height = data->height;
+    double xs[x1 - x0];
+
+    for(int i = x0; i < x1; i++) {
+        xs[i - x0] = data->xmin + i*(data->xmax-data->xmin)/width;
+    }
+    for(int j = y0; j < y1; j++) {
+        double y = data->ymin + j*(data->ymax-data->ymin)/height;
+        uint32_t *row = data->counts + (long)j * width;
+        atomic_fetch_add(&shortcut_pixels, escape_row(xs, y, x1 - x0, data->max, shortcuts, row + x0));
+    }
+}
+
+void compute_tile( thread_data_t *data, int tile )
+{
+    schedule_t *sc = data->schedule;
+    int x0 = (tile % sc->tiles_x) * sc->tile_size;
+    int y0 = (tile / sc->tiles_x) * sc->tile_size;
+    int x1 = x0 + sc->tile_size;
+    int y1 = y0 + sc->tile_size;
+
+    if(x1 > data->width) x1 = data->width;
+    if(y1 > data->height) y1 = data->height;
+    compute_region(data, x0, y0, x1, y1);
+    data->units++;
+}
+
+/*
+Make sure the iteration counts of row j from x0 up to x1 are known, running
+the kernel once on the ones that aren't.
+*/
+
+void subdivide_row( thread_data_t *data, int j, int x0, int x1 )
+{
+    // A rectangle less than 3 pixels wide has no inside.
+    if(x1 <= x0) {
+        return;
+    }
+
+    schedule_t *sc = data->schedule;
+    int width = data->width;
+    int height = data->height;
+    atomic_int *counts = sc->counts + (long)j * width;
+    double xs[x1 - x0];
+    int index[x1 - x0];
+    uint32_t iters[x1 - x0];
+    int n = 0;
+
+    for(int i = x0; i < x1; i++) {
+        if(atomic_load_explicit(&counts[i], memory_order_relaxed) < 0) {
+            xs[n] = data->xmin + i*(data->xmax-data->xmin)/width;
+            index[n++] = i;
+        }
+    }
+    if(n == 0) {
+        return;
+    }
+    double y = data->ymin + j*(data->ymax-data->ymin)/height;
+    atomic_fetch_add(&shortcut_pixels, (n == 1 ? escape_point : escape_row)(xs, y, n, data->max, shortcuts, iters));
+    // Two threads can compute the same split line at once; only the first to store a pixel counts it.
+    for(int k = 0; k < n; k++) {
+        int unknown = -1;
+        if(atomic_compare_exchange_strong_explicit(&counts[index[k]], &unknown, iters[k], memory_order_relaxed, memory_order_relaxed)) {
+            data->evaluated++;
+        }
+    }
+}
+
+void rect_push( schedule_t *sc, rect_t r )
+{
+    pthread_mutex_lock(&sc->lock);
+    if(sc->nrects == sc->rects_size) {
+        sc->rects_size = sc->rects_size ? sc->rects_size * 2 : 64;
+        sc->rects = realloc(sc->rects, sc->rects_size * sizeof(rect_t));
+    }
+    sc->rects[sc->nrects++] = r;
+    sc->pending++;
+    pthread_cond_signal(&sc->more);
+    pthread_mutex_unlock(&sc->lock);
+}
+
+// Wait for a rectangle to compute.  Returns 0 once every rectangle is done.
+int rect_pop( schedule_t *sc, rect_t *r )
+{
+    pthread_mutex_lock(&sc->lock);
+    while(sc->nrects == 0 && sc->pending > 0) {
+        pthread_cond_wait(&sc->more, &sc->lock);
+    }
+    int found = sc->nrects > 0;
+    if(found) {
+        *r = sc->rects[--sc->nrects];
+    }
+    pthread_mutex_unlock(&sc->lock);
+    return found;
+}
+
+void rect_done( schedule_t *sc )
+{
+    pthread_mutex_lock(&sc->lock);
+    if(--sc->pending == 0) {
+        pthread_cond_broadcast(&sc->more);
+    }
+    pthread_mutex_unlock(&sc->lock);
+}
+
+/*
+Whether rectangle r reaches the origin.  The points that last at least n
+iterations form one solid region around the whole set, which holds the
+origin, so a border of one count below max can only hide other counts inside
+when the rectangle goes all the way round the set, origin and all.
+*/
+int rect_holds_origin( thread_data_t *data, rect_t r )
+{
+    double x0 = data->xmin + r.x0*(data->xmax-data->xmin)/data->width;
+    double x1 = data->xmin + (r.x1 - 1)*(data->xmax-data->xmin)/data->width;
+    double y0 = data->ymin + r.y0*(data->ymax-data->ymin)/data->height;
+    double y1 = data->ymin + (r.y1 - 1)*(data->ymax-data->ymin)/data->height;
+
+    return x0 <= 0 && 0 <= x1 && y0 <= 0 && 0 <= y1;
+}
+
+/*
+Mariani-Silver: compute the border of a rectangle.  If every border pixel has
+the same count, so does the inside; otherwise split it in two along its longer
+side, hand one half to whichever thread is free and carry on with the other.
+The halves share the line they were split on, so it is only computed once.
+A border that is not max is only trusted away from the origin (see above).
+*/
+
+void compute_rect( thread_data_t *data, rect_t r )
+{
+    schedule_t *sc = data->schedule;
+    int width = data->width;
+
+    while(1) {
+        subdivide_row(data, r.y0, r.x0, r.x1);
+        subdivide_row(data, r.y1 - 1, r.x0, r.x1);
+        for(int j = r.y0 + 1; j < r.y1 - 1; j++) {
+            subdivide_row(data, j, r.x0, r.x0 + 1);
+            subdivide_row(data, j, r.x1 - 1, r.x1);
+        }
+
+        int count = atomic_load_explicit(&sc->counts[(long)r.y0 * width + r.x0], memory_order_relaxed);
+        int uniform = 1;
+        for(int i = r.x0; i < r.x1 && uniform; i++) {
+            uniform = atomic_load_explicit(&sc->counts[(long)r.y0 * width + i], memory_order_relaxed) == count
+                   && atomic_load_explicit(&sc->counts[(long)(r.y1 - 1) * width + i], memory_order_relaxed) == count;
+        }
+        for(int j = r.y0 + 1; j < r.y1 - 1 && uniform; j++) {
+            uniform = atomic_load_explicit(&sc->counts[(long)j * width + r.x0], memory_order_relaxed) == count
+                   && atomic_load_explicit(&sc->counts[(long)j * width + r.x1 - 1], memory_order_relaxed) == count;
+        }
+
+        if(uniform && (count == data->max || !rect_holds_origin(data, r))) {
+            for(int j = r.y0 + 1; j < r.y1 - 1; j++) {
+                for(int i = r.x0 + 1; i < r.x1 - 1; i++) {
+                    atomic_store_explicit(&sc->counts[(long)j * width + i], count, memory_order_relaxed);
+                }
+            }
+            return;
+        }
+        if(r.x1 - r.x0 < SUBDIVIDE_MIN || r.y1 - r.y0 < SUBDIVIDE_MIN) {
+            for(int j = r.y0 + 1; j < r.y1 - 1; j++) {
+                subdivide_row(data, j, r.x0 + 1, r.x1 - 1);
+            }
+            return;
+        }
+
+        rect_t other = r;
+        if(r.x1 - r.x0 >= r.y1 - r.y0) {
+            r.x1 = (r.x0 + r.x1) / 2 + 1;
+            other.x0 = r.x1 - 1;
+        } else {
+            r.y1 = (r.y0 + r.y1) / 2 + 1;
+            other.y0 = r.y1 - 1;
+        }
+        rect_push(sc, other);
+    }
+}
+
+// Take the next tile from the front of a deque, or from its back when stealing.  Returns -1 if it is empty.
+int deque_take( tile_deque_t *d, int from_back )
+{
+    unsigned long long range = atomic_load(&d->range);
+
+    while(1) {
+        unsigned lo = range & 0xffffffff;
+        unsigned hi = range >> 32;
+        if(lo >= hi) {
+            return -1;
+        }
+        unsigned long long taken = from_back ? ((unsigned long long)(hi - 1) << 32) | lo
+                                             : ((unsigned long long)hi << 32) | (lo + 1);
+        if(atomic_compare_exchange_weak(&d->range, &range, taken)) {
+            return from_back ? hi - 1 : lo;
+        }
+    }
+}
+
+double seconds_since( struct timespec *start )
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/*
+Compare every kernel this CPU supports, with and without shortcuts, against
+the scalar reference on the views from the help text and the mandelmovie
+path.  Returns the number of kernels whose iteration counts differ anywhere.
+*/
+
+int check_kernels( int width, int height )
+{
+    static const struct { double x, y, scale; int max; } views[] = {
+        { 0, 0, 4, 1000 },
+        { -0.5, -0.5, 0.2, 1000 },
+        { -.38, -.665, .05, 100 },
+        { 0.286932, 0.014287, .0005, 1000 },
+        { -0.5397949, -0.6095890009734, 1.0, 3500 },
+        { -0.5397949, -0.6095890009734, 0.0001, 3500 },
+    };
+    int nviews = sizeof(views) / sizeof(views[0]);
+    int failed = 0;
+    double xs[width];
+    uint32_t want[width], got[width];
+    const char *name;
+
+    for(int k = 0; escape_kernel_names[k]; k++)
+    for(int shortcut = 0; shortcut <= 1; shortcut++) {
+        if(k == 0 && !shortcut) {
+            continue;
+        }
+        escape_row_t kernel = escape_kernel(escape_kernel_names[k], &name);
+        if(!kernel) {
+            if(!shortcut) printf("%-8s not supported on this CPU\n", escape_kernel_names[k]);
+            continue;
+        }
+        long mismatches = 0, taken = 0, pixels = 0;
+        double seconds[2] = { 0, 0 };
+        for(int v = 0; v < nviews; v++) {
+            double xmin = views[v].x - views[v].scale, xmax = views[v].x + views[v].scale;
+            double ymin = views[v].y - views[v].scale, ymax = views[v].y + views[v].scale;
+            for(int i = 0; i < width; i++) {
+                xs[i] = xmin + i*(xmax-xmin)/width;
+            }
+            for(int j = 0; j < height; j++) {
+                double y = ymin + j*(ymax-ymin)/height;
+                struct timespec t0;
+                clock_gettime(CLOCK_MONOTONIC, &t0);
+                for(int i = 0; i < width; i++) {
+                    want[i] = escape_time(xs[i], y, views[v].max);
+                }
+                seconds[0] += seconds_since(&t0);
+                clock_gettime(CLOCK_MONOTONIC, &t0);
+                taken += kernel(xs, y, width, views[v].max, shortcut, got);
+                seconds[1] += seconds_since(&t0);
+                pixels += width;
+                for(int i = 0; i < width; i++) {
+                    mismatches += want[i] != got[i];
+                }
+            }
+        }
+        printf("%-8s %-9s %s: %ld mismatched pixels over %d views, %.3fs vs %.3fs scalar (%.2fx), %.1f%% short-circuited\n",
+               name, shortcut ? "shortcuts" : "", mismatches ? "FAIL" : "ok", mismatches, nviews,
+               seconds[1], seconds[0], seconds[0] / seconds[1], 100.0 * taken / pixels);
+        failed += mismatches != 0;
+    }
+    return failed;
+}
+
+/*
+Fill lut with the color of every iteration count from 0 to max, so the
+coloring pass is a lookup instead of an HSV conversion per pixel.
+*/
+
+void make_palette( uint32_t *lut, int max, int palette )
+{
+    for(int i = 0; i <= max; i++) {
+        if(palette == PALETTE_GRAY) {
+            int gray = 255*(long)i/max;
+            lut[i] = MAKE_RGBA(gray,gray,gray,0);
+        } else {
+            lut[i] = iteration_to_color(i,max);
+        }
+    }
+}
+
+// Color the whole bitmap from the counts, a row at a time.
+void color_image( struct bitmap *bm, const uint32_t *counts, const uint32_t *lut, color_row_t color_row )
+{
+    int width = bitmap_width(bm);
+    int height = bitmap_height(bm);
+    int *pixels = bitmap_data(bm);
+
+    for(int j = 0; j < height; j++) {
+        color_row(counts + (long)j * width, width, lut, pixels + (long)j * width);
+    }
+}
+
+// Write the iteration counts to a file.  Returns false on failure, with errno set.
+int save_counts( const char *path, const uint32_t *counts, int width, int height, int max )
+{
+    counts_header_t header;
+    FILE *file = fopen(path,"wb");
+    if(!file) return 0;
+
+    memcpy(header.magic, COUNTS_MAGIC, sizeof(header.magic));
+    header.width = width;
+    header.height = height;
+    header.max = max;
+
+    int ok = fwrite(&header,sizeof(header),1,file) == 1
+          && fwrite(counts,sizeof(uint32_t),(long)width*height,file) == (size_t)width*height;
+    if(fclose(file) != 0) ok = 0;
+    return ok;
+}
+
+/*
+Read iteration counts written by save_counts(), setting the size and max they
+were computed with.  Returns NULL on failure.
+*/
+
+uint32_t *load_counts( const char *path, int *width, int *height, int *max )
+{
+    counts_header_t header;
+    FILE *file = fopen(path,"rb");
+    if(!file) {
+        fprintf(stderr,"mandel: couldn't open %s: %s\n",path,strerror(errno));
+        return 0;
+    }
+
+    if(fread(&header,sizeof(header),1,file) != 1 || memcmp(header.magic, COUNTS_MAGIC, sizeof(header.magic)) != 0
+       || header.width <= 0 || header.height <= 0 || header.max <= 0) {
+        fprintf(stderr,"mandel: %s is not a file of iteration counts\n",path);
+        fclose(file);
+        return 0;
+    }
+
+    long size = (long)header.width * header.height;
+    uint32_t *counts = malloc(size * sizeof(uint32_t));
+    if(fread(counts,sizeof(uint32_t),size,file) != (size_t)size) {
+        fprintf(stderr,"mandel: %s is truncated\n",path);
+        free(counts);
+        fclose(file);
+        return 0;
+    }
+    fclose(file);
+
+    // A count past max would index off the end of the palette.
+    for(long i = 0; i < size; i++) {
+        if(counts[i] > (uint32_t)header.max) counts[i] = header.max;
+    }
+
+    *width = header.width;
+    *height = header.height;
+    *max = header.max;
+    return counts;
 }
 
 int main( int argc, char *argv[] )
@@ -86,11 +539,20 @@ int main( int argc, char *argv[] )
     int image_height = 500;
     int max = 1000;
     int num_threads = 1;
+    int mode = SCHEDULE_BANDS;
+    int tile_size = 0;
+    int verbose = 0;
+    int check = 0;
+    const char *kernel = "auto";
+    const char *kernel_name;
+    int palette = PALETTE_HSV;
+    const char *countsfile = NULL;
+    const char *recolor = NULL;
 
     // For each command line argument given,
     // override the appropriate configuration value.
 
-    while((c = getopt(argc,argv,"x:y:s:W:H:m:o:n:h"))!=-1) {
+    while((c = getopt(argc,argv,"x:y:s:W:H:m:o:n:t:T:vk:Ip:S:R:Ch"))!=-1) {
         switch(c) {
             case 'x':
                 xcenter = atof(optarg);
@@ -109,6 +571,10 @@ int main( int argc, char *argv[] )
                 break;
             case 'm':
                 max = atoi(optarg);
+                if(max < 1) {
+                    fprintf(stderr,"mandel: the maximum number of iterations must be at least 1\n");
+                    exit(1);
+                }
                 break;
             case 'o':
                 outfile = optarg;
@@ -116,6 +582,41 @@ int main( int argc, char *argv[] )
             case 'n':
                 num_threads = atoi(optarg);
                 break;
+            case 't':
+                for(mode = 0; mode < 5 && strcmp(optarg, schedule_names[mode]) != 0; mode++);
+                if(mode == 5) {
+                    fprintf(stderr,"mandel: unknown schedule %s\n",optarg);
+                    exit(1);
+                }
+                break;
+            case 'T':
+                tile_size = atoi(optarg) > 0 ? atoi(optarg) : 0;
+                break;
+            case 'v':
+                verbose = 1;
+                break;
+            case 'k':
+                kernel = optarg;
+                break;
+            case 'I':
+                shortcuts = 0;
+                break;
+            case 'p':
+                for(palette = 0; palette < 2 && strcmp(optarg, palette_names[palette]) != 0; palette++);
+                if(palette == 2) {
+                    fprintf(stderr,"mandel: unknown palette %s\n",optarg);
+                    exit(1);
+                }
+                break;
+            case 'S':
+                countsfile = optarg;
+                break;
+            case 'R':
+                recolor = optarg;
+                break;
+            case 'C':
+                check = 1;
+                break;
             case 'h':
                 show_help();
                 exit(1);
@@ -123,27 +624,88 @@ int main( int argc, char *argv[] )
         }
     }
 
+    escape_point = escape_kernel("scalar", &kernel_name);
+    escape_row = escape_kernel(kernel, &kernel_name);
+    if(!escape_row) {
+        fprintf(stderr,"mandel: kernel %s is unknown or not supported by this CPU\n",kernel);
+        exit(1);
+    }
+    if(check) {
+        exit(check_kernels(image_width,image_height) ? 1 : 0);
+    }
+    if(tile_size == 0) {
+        tile_size = mode == SCHEDULE_SUBDIVIDE ? SUBDIVIDE_SEED : 32;
+    }
+
     // // Display the configuration of the image.
     // printf("mandel: x=%lf y=%lf scale=%lf max=%d outfile=%s threads=%d\n",xcenter,ycenter,scale,max,outfile,num_threads);
 
-    // Create a bitmap of the appropriate size.
-    struct bitmap *bm = bitmap_create(image_width,image_height);
-
-
-    // Fill it with a dark blue, for debugging
-    bitmap_reset(bm,MAKE_RGBA(0,0,255,0));
+    // The iteration counts: computed below, or read back from an earlier run to recolor them.
+    uint32_t *counts;
+    if (recolor) {
+        counts = load_counts(recolor,&image_width,&image_height,&max);
+        if (!counts) return 1;
+    } else {
+        counts = malloc((long)image_width * image_height * sizeof(uint32_t));
+    }
 
     // Compute the Mandelbrot image
-    if (num_threads == 1) {
+    if (recolor) {
+        // Nothing to compute.
+    } else if (num_threads <= 1 && mode == SCHEDULE_BANDS) {
         // If only one thread, compute image in the main thread.
-        compute_image(bm,xcenter-scale,xcenter+scale,ycenter-scale,ycenter+scale,max);
+        compute_image(counts,image_width,image_height,xcenter-scale,xcenter+scale,ycenter-scale,ycenter+scale,max);
     } else {
         // If multiple threads, create and launch threads to compute the image.
+        if (num_threads < 1) num_threads = 1;
         pthread_t threads[num_threads];
         thread_data_t thread_data[num_threads];
+        schedule_t schedule;
         int lines_per_thread = image_height / num_threads;
+
+        schedule.mode = mode;
+        schedule.tile_size = tile_size;
+        schedule.tiles_x = (image_width + tile_size - 1) / tile_size;
+        schedule.ntiles = schedule.tiles_x * ((image_height + tile_size - 1) / tile_size);
+        schedule.nthreads = num_threads;
+        atomic_init(&schedule.next, 0);
+        schedule.deques = NULL;
+        if (mode == SCHEDULE_STEAL) {
+            // Each thread starts with an equal run of tiles, as in bands; the stealing evens it out.
+            schedule.deques = aligned_alloc(64, num_threads * sizeof(tile_deque_t));
+            for (int i = 0; i < num_threads; i++) {
+                unsigned long long lo = (unsigned long long)schedule.ntiles * i / num_threads;
+                unsigned long long hi = (unsigned long long)schedule.ntiles * (i + 1) / num_threads;
+                atomic_init(&schedule.deques[i].range, hi << 32 | lo);
+            }
+        }
+        pthread_mutex_init(&schedule.lock, NULL);
+        pthread_cond_init(&schedule.more, NULL);
+        schedule.rects = NULL;
+        schedule.nrects = 0;
+        schedule.rects_size = 0;
+        schedule.pending = 0;
+        schedule.counts = NULL;
+        if (mode == SCHEDULE_SUBDIVIDE) {
+            // Start with one rectangle per tile; the threads split them up between them.
+            schedule.counts = malloc((long)image_width * image_height * sizeof(atomic_int));
+            for (long i = 0; i < (long)image_width * image_height; i++) {
+                atomic_init(&schedule.counts[i], -1);
+            }
+            for (int tile = schedule.ntiles - 1; tile >= 0; tile--) {
+                int x0 = (tile % schedule.tiles_x) * tile_size;
+                int y0 = (tile / schedule.tiles_x) * tile_size;
+                rect_push(&schedule, (rect_t){ x0, y0, x0 + tile_size < image_width ? x0 + tile_size : image_width,
+                                                       y0 + tile_size < image_height ? y0 + tile_size : image_height });
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &schedule.start);
+
         for (int i = 0; i < num_threads; i++) {
-            thread_data[i].bm = bm;
+            memset(&thread_data[i], 0, sizeof(thread_data[i]));
+            thread_data[i].counts = counts;
+            thread_data[i].width = image_width;
+            thread_data[i].height = image_height;
             thread_data[i].xmin = xcenter - scale;
             thread_data[i].xmax = xcenter + scale;
             thread_data[i].ymin = ycenter - scale;
@@ -151,97 +713,153 @@ int main( int argc, char *argv[] )
             thread_data[i].max = max;
             thread_data[i].start_line = i * lines_per_thread;
             thread_data[i].end_line = (i == num_threads - 1) ? image_height : (i + 1) * lines_per_thread;
+            thread_data[i].id = i;
+            thread_data[i].schedule = &schedule;
             pthread_create(&threads[i], NULL, compute_image_thread, &thread_data[i]);
         }
         // Wait for all threads to complete.
         for (int i = 0; i < num_threads; i++) {
             pthread_join(threads[i], NULL);
         }
+
+        if (verbose) {
+            double total = 0, most = 0;
+            for (int i = 0; i < num_threads; i++) {
+                thread_data_t *t = &thread_data[i];
+                printf("mandel: thread %d: busy %.3fs, done at %.3fs, %d %s", i, t->busy, t->finished, t->units,
+                       mode == SCHEDULE_BANDS || mode == SCHEDULE_ROWS ? "rows" :
+                       mode == SCHEDULE_SUBDIVIDE ? "rectangles" : "tiles");
+                if (mode == SCHEDULE_STEAL) {
+                    printf(" (%d stolen)", t->stolen);
+                }
+                printf("\n");
+                total += t->busy;
+                if (t->busy > most) most = t->busy;
+            }
+            printf("mandel: schedule=%s imbalance (busiest/mean) %.2f\n", schedule_names[mode],
+                   total > 0 ? most / (total / num_threads) : 1.0);
+        }
+        if (mode == SCHEDULE_SUBDIVIDE) {
+            long evaluated = 0;
+            for (int i = 0; i < num_threads; i++) {
+                evaluated += thread_data[i].evaluated;
+            }
+            for (long i = 0; i < (long)image_width * image_height; i++) {
+                counts[i] = schedule.counts[i];
+            }
+            printf("mandel: evaluated %ld of %d pixels (%.1f%%)\n", evaluated, image_width * image_height,
+                   100.0 * evaluated / (image_width * image_height));
+        }
+        free(schedule.deques);
+        free(schedule.rects);
+        free(schedule.counts);
+        pthread_mutex_destroy(&schedule.lock);
+        pthread_cond_destroy(&schedule.more);
+    }
+
+    // Color the counts into a bitmap of the appropriate size.
+    struct timespec colored;
+    clock_gettime(CLOCK_MONOTONIC, &colored);
+    uint32_t *lut = malloc((max + 1) * sizeof(uint32_t));
+    make_palette(lut, max, palette);
+    struct bitmap *bm = bitmap_create(image_width,image_height);
+    color_image(bm, counts, lut, color_kernel(kernel));
+    if (verbose) {
+        printf("mandel: colored with %s in %f seconds\n", palette_names[palette], seconds_since(&colored));
     }
 
     clock_gettime(CLOCK_MONOTONIC, &end);
     double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
-    printf("mandel: x=%lf y=%lf scale=%lf max=%d outfile=%s threads=%d Time taken: %f seconds\n",xcenter,ycenter,scale,max,outfile,num_threads, elapsed);
+    if(recolor) {
+        printf("mandel: recolored %s max=%d outfile=%s Time taken: %f seconds\n",recolor,max,outfile,elapsed);
+    } else {
+        printf("mandel: x=%lf y=%lf scale=%lf max=%d outfile=%s threads=%d Time taken: %f seconds\n",xcenter,ycenter,scale,max,outfile,num_threads, elapsed);
+    }
+    if(shortcuts && !recolor) {
+        long taken = atomic_load(&shortcut_pixels);
+        printf("mandel: interior shortcuts: %ld of %d pixels (%.1f%%)\n",taken,image_width*image_height,100.0*taken/(image_width*image_height));
+    }
 
     // Save the image in the stated file.
     if(!bitmap_save(bm,outfile)) {
         fprintf(stderr,"mandel: couldn't write to %s: %s\n",outfile,strerror(errno));
         return 1;
     }
+    if(countsfile && !save_counts(countsfile,counts,image_width,image_height,max)) {
+        fprintf(stderr,"mandel: couldn't write to %s: %s\n",countsfile,strerror(errno));
+        return 1;
+    }
 
+    bitmap_delete(bm);
+    free(lut);
+    free(counts);
     return 0;
 }
 
 
 /*
-Compute an entire Mandelbrot image using threads, writing each point to the given bitmap.
+Compute an entire Mandelbrot image using threads, writing each point's iteration count to the counts buffer.
 Scale the image to the range (xmin-xmax,ymin-ymax), limiting iterations to "max"
 */
 
 void *compute_image_thread(void *thread_arg)
 {
     thread_data_t *data = (thread_data_t *)thread_arg;
-    struct bitmap *bm = data->bm;
-    double xmin = data->xmin;
-    double xmax = data->xmax;
-    double ymin = data->ymin;
-    double ymax = data->ymax;
-    int max = data->max;
-    int start_line = data->start_line;
-    int end_line = data->end_line;
-
-    int i,j;
-
-    int width = bitmap_width(bm);
-    int height = bitmap_height(bm);
-
-    // For every pixel in the image...
-
-    for(j = start_line; j < end_line; j++) {
-
-        for(i = 0; i < width; i++) {
-
-            // Determine the point in x,y space for that pixel.
-            double x = xmin + i*(xmax-xmin)/width;
-            double y = ymin + j*(ymax-ymin)/height;
-
-            // Compute the iterations at that point.
-            int iters = iterations_at_point(x,y,max);
-
-            // Set the pixel in the bitmap.
-            bitmap_set(bm,i,j,iters);
+    schedule_t *sc = data->schedule;
+    int height = data->height;
+    int width = data->width;
+    struct timespec cpu;
+    int unit;
+
+    switch(sc->mode) {
+        case SCHEDULE_BANDS:
+            compute_region(data, 0, data->start_line, width, data->end_line);
+            data->units = data->end_line - data->start_line;
+            break;
+        case SCHEDULE_ROWS:
+            // Rows are handed out one at a time, so neighbouring rows go to different threads.
+            while((unit = atomic_fetch_add(&sc->next, 1)) < height) {
+                compute_region(data, 0, unit, width, unit + 1);
+                data->units++;
+            }
+            break;
+        case SCHEDULE_TILES:
+            while((unit = atomic_fetch_add(&sc->next, 1)) < sc->ntiles) {
+                compute_tile(data, unit);
+            }
+            break;
+        case SCHEDULE_STEAL:
+            while((unit = deque_take(&sc->deques[data->id], 0)) >= 0) {
+                compute_tile(data, unit);
+            }
+            // Out of our own tiles: take from the back of the others' until every deque is empty.
+            for(int victim = 1; victim < sc->nthreads; ) {
+                unit = deque_take(&sc->deques[(data->id + victim) % sc->nthreads], 1);
+                if(unit < 0) {
+                    victim++;
+                    continue;
+                }
+                compute_tile(data, unit);
+                data->stolen++;
+            }
+            break;
+        case SCHEDULE_SUBDIVIDE: {
+            rect_t r;
+            while(rect_pop(sc, &r)) {
+                compute_rect(data, r);
+                rect_done(sc);
+                data->units++;
+            }
+            break;
         }
     }
 
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+    data->busy = cpu.tv_sec + cpu.tv_nsec / 1e9;
+    data->finished = seconds_since(&sc->start);
     return NULL;
 }
 
-/*
-Return the number of iterations at point x, y
-in the Mandelbrot space, up to a maximum of max.
-*/
-
-int iterations_at_point( double x, double y, int max )
-{
-    double x0 = x;
-    double y0 = y;
-
-    int iter = 0;
-
-    while( (x*x + y*y <= 4) && iter < max ) {
-
-        double xt = x*x - y*y + x0;
-        double yt = 2*x*y + y0;
-
-        x = xt;
-        y = yt;
-
-        iter++;
-    }
-
-    return iteration_to_color(iter,max);
-}
-
 /*
 Convert a iteration number to an RGBA color.
 Here, we just scale to gray with a maximum of imax.
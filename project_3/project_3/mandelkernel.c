@@ -0,0 +1,366 @@
+#include <string.h>
+
+// The vector kernels are x86 only; elsewhere the scalar ones are all there is.
+#if defined(__x86_64__) || defined(__i386__)
+#define X86_KERNELS
+#include <immintrin.h>
+#endif
+
+#include "mandelkernel.h"
+
+/*
+Every kernel does exactly the scalar arithmetic, in the same order and with
+no fused multiply-adds (this file is built with -ffp-contract=off), so they
+all return the same iteration counts.  A lane that escapes keeps its last
+x and y, so it stays escaped while the others go on.
+
+With shortcuts on, a point is given max iterations without running them out
+when it lies in the main cardioid or the period-2 bulb, or when its orbit
+comes back exactly to a point it has already visited.  The saved point is
+moved Brent-style, at iterations 1, 2, 4, 8, ... so a cycle of any length is
+caught.  An orbit that repeats bit for bit can never escape, so this cannot
+change a count; the cardioid and bulb tests are strict, leaving points on
+the boundary to the full loop.
+*/
+
+const char *escape_kernel_names[] = { "scalar", "sse2", "avx2", "avx512", 0 };
+
+// Lanes past the end of a row start here, outside the set, so they escape at once.
+#define OUTSIDE 4.0
+
+int escape_time( double x, double y, int max )
+{
+    double x0 = x;
+    double y0 = y;
+
+    int iter = 0;
+
+    while( (x*x + y*y <= 4) && iter < max ) {
+
+        double xt = x*x - y*y + x0;
+        double yt = 2*x*y + y0;
+
+        x = xt;
+        y = yt;
+
+        iter++;
+    }
+
+    return iter;
+}
+
+// True if x + y*i is strictly inside the main cardioid or the period-2 bulb.
+static int escape_interior( double x, double y )
+{
+    double xq = x - 0.25;
+    double q = xq*xq + y*y;
+
+    if(q*(q + xq) < 0.25*y*y) return 1;
+    return (x + 1)*(x + 1) + y*y < 0.0625;
+}
+
+// escape_time() with shortcuts.  Sets *shortcut if it took one.
+static int escape_time_shortcut( double x, double y, int max, int *shortcut )
+{
+    double x0 = x;
+    double y0 = y;
+    double sx = x, sy = y;
+    int steps = 0, period = 1;
+
+    int iter = 0;
+
+    *shortcut = 1;
+    if(escape_interior(x, y)) return max;
+
+    while( (x*x + y*y <= 4) && iter < max ) {
+
+        double xt = x*x - y*y + x0;
+        double yt = 2*x*y + y0;
+
+        x = xt;
+        y = yt;
+
+        iter++;
+
+        if(x == sx && y == sy) return max;
+        if(++steps == period) {
+            sx = x;
+            sy = y;
+            steps = 0;
+            period *= 2;
+        }
+    }
+
+    *shortcut = 0;
+    return iter;
+}
+
+static int escape_row_scalar( const double *xs, double y, int n, int max, int shortcuts, uint32_t *iters )
+{
+    int taken = 0;
+
+    for(int i = 0; i < n; i++) {
+        if(shortcuts) {
+            int shortcut;
+            iters[i] = escape_time_shortcut(xs[i], y, max, &shortcut);
+            taken += shortcut;
+        } else {
+            iters[i] = escape_time(xs[i], y, max);
+        }
+    }
+    return taken;
+}
+
+#ifdef X86_KERNELS
+
+/*
+Copy up to lanes points into block, padding the rest, and return how many are
+real.  With shortcuts, points in the cardioid or bulb are replaced by padding
+too, and their lanes are set in *interior.
+*/
+static int load_block( double *block, const double *xs, double y, int i, int n, int lanes, int shortcuts, int *interior )
+{
+    int count = n - i < lanes ? n - i : lanes;
+
+    *interior = 0;
+    for(int k = 0; k < lanes; k++) {
+        block[k] = k < count ? xs[i + k] : OUTSIDE;
+        if(k < count && shortcuts && escape_interior(block[k], y)) {
+            block[k] = OUTSIDE;
+            *interior |= 1 << k;
+        }
+    }
+    return count;
+}
+
+// Store a block's counts, giving max to the lanes in shortcut.  Returns how many those were.
+static int store_block( uint32_t *iters, const double *counts, int count, int shortcut, int max )
+{
+    int taken = 0;
+
+    for(int k = 0; k < count; k++) {
+        if(shortcut & (1 << k)) {
+            iters[k] = max;
+            taken++;
+        } else {
+            iters[k] = (int)counts[k];
+        }
+    }
+    return taken;
+}
+
+__attribute__((target("sse2")))
+static int escape_row_sse2( const double *xs, double y, int n, int max, int shortcuts, uint32_t *iters )
+{
+    const __m128d four = _mm_set1_pd(4.0), two = _mm_set1_pd(2.0), one = _mm_set1_pd(1.0);
+    double block[2], counts[2];
+    int taken = 0;
+
+    for(int i = 0; i < n; i += 2) {
+        int interior;
+        int count = load_block(block, xs, y, i, n, 2, shortcuts, &interior);
+        __m128d x0 = _mm_loadu_pd(block), y0 = _mm_set1_pd(y);
+        __m128d x = x0, yv = y0, iter = _mm_setzero_pd();
+        __m128d sx = x, sy = yv, cycled = _mm_setzero_pd();
+        int steps = 0, period = 1;
+
+        for(int k = 0; k < max; k++) {
+            __m128d x2 = _mm_mul_pd(x, x), y2 = _mm_mul_pd(yv, yv);
+            __m128d active = _mm_andnot_pd(cycled, _mm_cmple_pd(_mm_add_pd(x2, y2), four));
+            if(!_mm_movemask_pd(active)) break;
+            iter = _mm_add_pd(iter, _mm_and_pd(active, one));
+            __m128d xt = _mm_add_pd(_mm_sub_pd(x2, y2), x0);
+            __m128d yt = _mm_add_pd(_mm_mul_pd(_mm_mul_pd(two, x), yv), y0);
+            x = _mm_or_pd(_mm_and_pd(active, xt), _mm_andnot_pd(active, x));
+            yv = _mm_or_pd(_mm_and_pd(active, yt), _mm_andnot_pd(active, yv));
+            if(shortcuts) {
+                __m128d same = _mm_and_pd(_mm_cmpeq_pd(x, sx), _mm_cmpeq_pd(yv, sy));
+                cycled = _mm_or_pd(cycled, _mm_and_pd(active, same));
+                if(++steps == period) {
+                    sx = x;
+                    sy = yv;
+                    steps = 0;
+                    period *= 2;
+                }
+            }
+        }
+        _mm_storeu_pd(counts, iter);
+        taken += store_block(iters + i, counts, count, interior | _mm_movemask_pd(cycled), max);
+    }
+    return taken;
+}
+
+__attribute__((target("avx2")))
+static int escape_row_avx2( const double *xs, double y, int n, int max, int shortcuts, uint32_t *iters )
+{
+    const __m256d four = _mm256_set1_pd(4.0), two = _mm256_set1_pd(2.0), one = _mm256_set1_pd(1.0);
+    double block[4], counts[4];
+    int taken = 0;
+
+    for(int i = 0; i < n; i += 4) {
+        int interior;
+        int count = load_block(block, xs, y, i, n, 4, shortcuts, &interior);
+        __m256d x0 = _mm256_loadu_pd(block), y0 = _mm256_set1_pd(y);
+        __m256d x = x0, yv = y0, iter = _mm256_setzero_pd();
+        __m256d sx = x, sy = yv, cycled = _mm256_setzero_pd();
+        int steps = 0, period = 1;
+
+        for(int k = 0; k < max; k++) {
+            __m256d x2 = _mm256_mul_pd(x, x), y2 = _mm256_mul_pd(yv, yv);
+            __m256d active = _mm256_andnot_pd(cycled, _mm256_cmp_pd(_mm256_add_pd(x2, y2), four, _CMP_LE_OQ));
+            if(!_mm256_movemask_pd(active)) break;
+            iter = _mm256_add_pd(iter, _mm256_and_pd(active, one));
+            __m256d xt = _mm256_add_pd(_mm256_sub_pd(x2, y2), x0);
+            __m256d yt = _mm256_add_pd(_mm256_mul_pd(_mm256_mul_pd(two, x), yv), y0);
+            x = _mm256_blendv_pd(x, xt, active);
+            yv = _mm256_blendv_pd(yv, yt, active);
+            if(shortcuts) {
+                __m256d same = _mm256_and_pd(_mm256_cmp_pd(x, sx, _CMP_EQ_OQ), _mm256_cmp_pd(yv, sy, _CMP_EQ_OQ));
+                cycled = _mm256_or_pd(cycled, _mm256_and_pd(active, same));
+                if(++steps == period) {
+                    sx = x;
+                    sy = yv;
+                    steps = 0;
+                    period *= 2;
+                }
+            }
+        }
+        _mm256_storeu_pd(counts, iter);
+        taken += store_block(iters + i, counts, count, interior | _mm256_movemask_pd(cycled), max);
+    }
+    return taken;
+}
+
+__attribute__((target("avx512f")))
+static int escape_row_avx512( const double *xs, double y, int n, int max, int shortcuts, uint32_t *iters )
+{
+    const __m512d four = _mm512_set1_pd(4.0), two = _mm512_set1_pd(2.0), one = _mm512_set1_pd(1.0);
+    double block[8], counts[8];
+    int taken = 0;
+
+    for(int i = 0; i < n; i += 8) {
+        int interior;
+        int count = load_block(block, xs, y, i, n, 8, shortcuts, &interior);
+        __m512d x0 = _mm512_loadu_pd(block), y0 = _mm512_set1_pd(y);
+        __m512d x = x0, yv = y0, iter = _mm512_setzero_pd();
+        __m512d sx = x, sy = yv;
+        __mmask8 cycled = 0;
+        int steps = 0, period = 1;
+
+        for(int k = 0; k < max; k++) {
+            __m512d x2 = _mm512_mul_pd(x, x), y2 = _mm512_mul_pd(yv, yv);
+            __mmask8 active = _mm512_cmp_pd_mask(_mm512_add_pd(x2, y2), four, _CMP_LE_OQ) & ~cycled;
+            if(!active) break;
+            iter = _mm512_mask_add_pd(iter, active, iter, one);
+            __m512d xt = _mm512_add_pd(_mm512_sub_pd(x2, y2), x0);
+            __m512d yt = _mm512_add_pd(_mm512_mul_pd(_mm512_mul_pd(two, x), yv), y0);
+            x = _mm512_mask_mov_pd(x, active, xt);
+            yv = _mm512_mask_mov_pd(yv, active, yt);
+            if(shortcuts) {
+                cycled |= _mm512_mask_cmp_pd_mask(_mm512_mask_cmp_pd_mask(active, x, sx, _CMP_EQ_OQ), yv, sy, _CMP_EQ_OQ);
+                if(++steps == period) {
+                    sx = x;
+                    sy = yv;
+                    steps = 0;
+                    period *= 2;
+                }
+            }
+        }
+        _mm512_storeu_pd(counts, iter);
+        taken += store_block(iters + i, counts, count, interior | cycled, max);
+    }
+    return taken;
+}
+
+#endif
+
+static void color_row_scalar( const uint32_t *counts, int n, const uint32_t *lut, int *pixels )
+{
+    for(int i = 0; i < n; i++) {
+        pixels[i] = lut[counts[i]];
+    }
+}
+
+#ifdef X86_KERNELS
+
+__attribute__((target("avx2")))
+static void color_row_avx2( const uint32_t *counts, int n, const uint32_t *lut, int *pixels )
+{
+    int i = 0;
+
+    for(; i + 8 <= n; i += 8) {
+        __m256i index = _mm256_loadu_si256((const __m256i *)(counts + i));
+        _mm256_storeu_si256((__m256i *)(pixels + i), _mm256_i32gather_epi32((const int *)lut, index, 4));
+    }
+    color_row_scalar(counts + i, n - i, lut, pixels + i);
+}
+
+__attribute__((target("avx512f")))
+static void color_row_avx512( const uint32_t *counts, int n, const uint32_t *lut, int *pixels )
+{
+    int i = 0;
+
+    for(; i + 16 <= n; i += 16) {
+        __m512i index = _mm512_loadu_si512(counts + i);
+        _mm512_storeu_si512(pixels + i, _mm512_i32gather_epi32(index, lut, 4));
+    }
+    if(i < n) {
+        __mmask16 rest = (1 << (n - i)) - 1;
+        __m512i index = _mm512_maskz_loadu_epi32(rest, counts + i);
+        _mm512_mask_storeu_epi32(pixels + i, rest, _mm512_mask_i32gather_epi32(index, rest, index, lut, 4));
+    }
+}
+
+#else
+
+// Placeholders for the tables below; kernels_supported() never picks them here.
+#define escape_row_sse2 escape_row_scalar
+#define escape_row_avx2 escape_row_scalar
+#define escape_row_avx512 escape_row_scalar
+#define color_row_avx2 color_row_scalar
+#define color_row_avx512 color_row_scalar
+
+#endif
+
+// Which kernels this CPU can run, indexed like escape_kernel_names.
+static void kernels_supported( int *supported )
+{
+    supported[0] = 1;
+#ifdef X86_KERNELS
+    __builtin_cpu_init();
+    supported[1] = __builtin_cpu_supports("sse2");
+    supported[2] = __builtin_cpu_supports("avx2");
+    supported[3] = __builtin_cpu_supports("avx512f");
+#else
+    supported[1] = supported[2] = supported[3] = 0;
+#endif
+}
+
+escape_row_t escape_kernel( const char *wanted, const char **name )
+{
+    static const escape_row_t kernels[] = { escape_row_scalar, escape_row_sse2, escape_row_avx2, escape_row_avx512 };
+    int supported[4];
+
+    kernels_supported(supported);
+    for(int k = 3; k >= 0; k--) {
+        if(supported[k] && (strcmp(wanted, "auto") == 0 || strcmp(wanted, escape_kernel_names[k]) == 0)) {
+            *name = escape_kernel_names[k];
+            return kernels[k];
+        }
+    }
+    return 0;
+}
+
+color_row_t color_kernel( const char *wanted )
+{
+    static const color_row_t kernels[] = { color_row_scalar, color_row_scalar, color_row_avx2, color_row_avx512 };
+    int supported[4];
+
+    kernels_supported(supported);
+    for(int k = 3; k >= 0; k--) {
+        if(supported[k] && (strcmp(wanted, "auto") == 0 || strcmp(wanted, escape_kernel_names[k]) == 0)) {
+            return kernels[k];
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef MANDELKERNEL_H
+#define MANDELKERNEL_H
+
+#include <stdint.h>
+
+/**
+Compute the escape time of n points on one row: for each xs[i] + y*i, the
+number of iterations before it leaves the circle of radius 2, up to max.
+If shortcuts is set, points found to be inside the set are given max without
+iterating that far; returns how many points that was.
+*/
+typedef int (*escape_row_t)( const double *xs, double y, int n, int max, int shortcuts, uint32_t *iters );
+
+/** The reference: the escape time of a single point, one iteration at a time. */
+int escape_time( double x, double y, int max );
+
+/**
+Find a row kernel by name: scalar, sse2, avx2, avx512, or auto for the widest
+this CPU supports.  Returns NULL if there is no such kernel or the CPU can't
+run it; otherwise *name is set to the kernel's own name.
+*/
+escape_row_t escape_kernel( const char *wanted, const char **name );
+
+/**
+Color n pixels from their iteration counts by looking each one up in lut,
+which has an entry for every count from 0 to max.
+*/
+typedef void (*color_row_t)( const uint32_t *counts, int n, const uint32_t *lut, int *pixels );
+
+/**
+Find a coloring kernel by the same names as escape_kernel().  sse2 has no
+gather, so it gets the scalar one.  Returns NULL like escape_kernel().
+*/
+color_row_t color_kernel( const char *wanted );
+
+/** The kernel names escape_kernel() knows, widest last, NULL-terminated. */
+extern const char *escape_kernel_names[];
+
+#endif